@@ -46,7 +46,12 @@ outer_simulator = outer_simualtor_string[outer_simulator_index]
 
 rz_precision = np.pi/512
 rz_data_point = int(2 * np.pi / rz_precision + 0.5)
-if outer_simulator == "SliQSim" or debug:
+sliqsim_native_rz = False
+# pass rz to SliQSim as one exact gate (--rz_res) instead of its gridsynth expansion
+# the state then keeps 2*res integers, so each gate costs about res/2 times more
+sliqsim_res = int(np.pi / rz_precision + 0.5)
+sliqsim_args = (" --rz_res %d" % sliqsim_res) if sliqsim_native_rz else ""
+if (outer_simulator == "SliQSim" and not sliqsim_native_rz) or debug:
     data_folder = "gridsynth_precompile"
     data_name = "gridsynth_%d.data" % rz_data_point
     assert(data_name in os.listdir(data_folder))
@@ -108,36 +113,24 @@ def circuit_outer(params):
                 qasm_str = qasm_str.split(' ')
                 rz_theta = float(qasm_str[0].strip('rz()'))
                 qubit_wire = int(qasm_str[1].strip('q[];'))
-                multiple = round(float( rz_theta / rz_precision)) % rz_data_point
-                for gate in precompile[multiple]:
-                    if gate == "Q":
-                        gate = "sdg"
-                    gate = gate.lower()
-                    basic_file_content += ("%s q[%d]; \n" % (gate, qubit_wire))
+                basic_file_content += rz_to_sliqsim(rz_theta, qubit_wire)
 
-        result = 0
+        # expval: all Pauli strings are evaluated on one simulation
+        file_content = basic_file_content
         for i in range(len(pstr_ops)):
-            file_content = basic_file_content
-
-            # expval
-            for op in pstr_ops[i]:
-                qubit_wire_z = int(op[1:].strip('()'))
-                file_content += ("exp_val q[%d]; \n" % (qubit_wire_z))
+            qubit_wires_z = [int(op[1:].strip('()')) for op in pstr_ops[i] if op.startswith('Z')]
+            file_content += ("exp_term %.17g" % float(pstr_coeffs[i])) + "".join(" q[%d]" % w for w in qubit_wires_z) + "; \n"
 
-            qasm_path_sliqsim = "sliqsim.qasm"
-            with open(qasm_path_sliqsim, 'w') as file:
-                file.write(file_content)
+        qasm_path_sliqsim = "sliqsim.qasm"
+        with open(qasm_path_sliqsim, 'w') as file:
+            file.write(file_content)
 
-            # execute
-            exe_result = os.popen("./SliQSim --sim_qasm " + qasm_path_sliqsim).read().split('\n')
-            for line in exe_result:
-                if line.startswith("The expectation value is"):
-                    exp_v = float(line.split()[-1])
-                    # Weird bug when pstr_ops[i] has 2 elements (temporary fix)
-                    if len(pstr_ops[i]) == 2:
-                        exp_v = -exp_v
-            # print(exp_v)
-            result += pstr_coeffs[i] * exp_v
+        # execute
+        result = 0
+        exe_result = os.popen("./SliQSim --sim_qasm " + qasm_path_sliqsim + sliqsim_args).read().split('\n')
+        for line in exe_result:
+            if line.startswith("The expectation value is"):
+                result = float(line.split()[-1])
 
         return np.array(result)
     elif outer_simulator == "DDSIM":
@@ -193,6 +186,19 @@ def prob_circuit(params):
     qml.layer(qaoa_layer, depth, params[0], params[1])
     return qml.probs(wires=range(n_vertex))
 
+def rz_to_sliqsim(rz_theta, qubit_wire):
+    multiple = round(float( rz_theta / rz_precision)) % rz_data_point
+    if sliqsim_native_rz:
+        return "rz(%d*pi/%d) q[%d]; \n" % (multiple, sliqsim_res, qubit_wire)
+    content = ""
+    for gate in precompile[multiple]:
+        if gate == "Q":
+            gate = "sdg"
+        gate = gate.lower()
+        content += ("%s q[%d]; \n" % (gate, qubit_wire))
+    return content
+
+
 def prob_circuit_outer(params, shots=1000):
     # export qasm file
     circuit.construct([params], {})
@@ -214,21 +220,16 @@ def prob_circuit_outer(params, shots=1000):
                 qasm_str = qasm_str.split(' ')
                 rz_theta = float(qasm_str[0].strip('rz()'))
                 qubit_wire = int(qasm_str[1].strip('q[];'))
-                multiple = round(float( rz_theta / rz_precision)) % rz_data_point
-                for gate in precompile[multiple]:
-                    if gate == "Q":
-                        gate = "sdg"
-                    gate = gate.lower()
-                    basic_file_content += ("%s q[%d]; \n" % (gate, qubit_wire))
+                basic_file_content += rz_to_sliqsim(rz_theta, qubit_wire)
 
         qasm_path_sliqsim = "sliqsim.qasm"
         with open(qasm_path_sliqsim, 'w') as file:
             file.write(basic_file_content)
 
-        # execute
-        exe_result = os.popen("./SliQSim --sim_qasm " + qasm_path_sliqsim + (" --shots %d" %(shots))).read().split('\n')
-        count = ast.literal_eval(exe_result[0])['counts']
-        return [count.setdefault(bin(i).lstrip('0b')[::-1].ljust(n_vertex,'0'),0)/shots for i in range(2**n_vertex)]
+        # execute in probability mode: exact distribution indexed by the clbits, no sampling
+        exe_result = os.popen("./SliQSim --sim_qasm " + qasm_path_sliqsim + sliqsim_args + " --type 2").read().split('\n')
+        probs = ast.literal_eval(exe_result[0])['probabilities']
+        return [probs[int(bin(i)[2:].zfill(n_vertex)[::-1], 2)] for i in range(2**n_vertex)]
     elif outer_simulator == "DDSIM":
         qasm_sim_path = 'ddsim.qasm'
         with open(qasm_sim_path, 'w') as file:
@@ -13,7 +13,8 @@ from sklearn import datasets
 
 DEBUG = None
 def main(filename, n_qubits = None, n_layers = 6, n_iter = 60, unit = None, simulator = None,
-         padding_const = 0.3, train_ratio = 0.75, weights0 = 1.0, bias0 = 0.0, stepsize = 0.01, batch_size = 5):
+         padding_const = 0.3, train_ratio = 0.75, weights0 = 1.0, bias0 = 0.0, stepsize = 0.01, batch_size = 5,
+         native_rz = False):
 
     np.random.seed(0)
 
@@ -36,7 +37,7 @@ def main(filename, n_qubits = None, n_layers = 6, n_iter = 60, unit = None, simu
     Y = data[:, -1]
 
     # read needed file for SliQSim
-    if simulator == "SliQSim":
+    if simulator == "SliQSim" and not native_rz:
         frac = int(2 * np.pi / unit + 0.5)
         assert(("gridsynth_%d.data" % frac) in os.listdir())
         with open("gridsynth_%d.data" % frac) as file:
@@ -44,6 +45,23 @@ def main(filename, n_qubits = None, n_layers = 6, n_iter = 60, unit = None, simu
 
     # ========================================== Function Definition
 
+    def sliqsim_rz(angle, q_index):
+        # rz(angle) as one exact gate (--rz_res) or as its gridsynth expansion
+        frac = int(2 * np.pi / unit + 0.5)
+        try:
+            multiple = round(float( angle / unit)) % frac
+        except:
+            multiple = round(float( angle._value / unit)) % frac
+        if native_rz:
+            return "rz(%d*pi/%d) q[%d]; \n" % (multiple, frac // 2, q_index)
+        content = ""
+        for gate in precompile[multiple]:
+            if gate == "Q":
+                gate = "sdg"
+            gate = gate.lower()
+            content += ("%s q[%d]; \n" % (gate, q_index))
+        return content
+
     def sliqsim(weights, init_state):
         frac = int(2 * np.pi / unit + 0.5)
 
@@ -52,54 +70,31 @@ def main(filename, n_qubits = None, n_layers = 6, n_iter = 60, unit = None, simu
         file_content += ("OPENQASM 2.0; \n")
         file_content += ('include "qelib1.inc"; \n')
         file_content += ("qreg q[%d]; \n" % n_qubits)
-        file_content += ("initial_state \n")
-        for entry in init_state:
-            file_content += (str(entry+0+0j).replace("j","i").replace("(","").replace(")","") + " \n")
+        # only the nonzero amplitudes, as index, real and imaginary part
+        amplitudes = [(i, complex(entry)) for i, entry in enumerate(init_state) if complex(entry) != 0]
+        file_content += ("initial_state sparse %d \n" % len(amplitudes))
+        for i, entry in amplitudes:
+            file_content += ("%d %.17g %.17g \n" % (i, entry.real, entry.imag))
 
         # circuit
         for W in weights:
             for i in range(n_qubits):
                 # Rz(W[i,0])
-                try:
-                    multiple = round(float( W[i,0] / unit)) % frac
-                except:
-                    multiple = round(float( W[i,0]._value / unit)) % frac
-
-                for gate in precompile[multiple]:
-                    if gate == "Q":
-                        gate = "sdg"
-                    gate = gate.lower()
-                    file_content += ("%s q[%d]; \n" % (gate, n_qubits - 1 - i))
+                file_content += sliqsim_rz(W[i,0], n_qubits - 1 - i)
 
                 # Sdg H
                 file_content += ("sdg q[%d]; \n" % (n_qubits - 1 - i))
                 file_content += ("h q[%d]; \n" % (n_qubits - 1 - i))
 
                 # Rz(W[i,1])
-                try:
-                    multiple = round(float( W[i,1] / unit)) % frac
-                except:
-                    multiple = round(float( W[i,1]._value / unit)) % frac
-                for gate in precompile[multiple]:
-                    if gate == "Q":
-                        gate = "sdg"
-                    gate = gate.lower()
-                    file_content += ("%s q[%d]; \n" % (gate, n_qubits - 1 - i))
+                file_content += sliqsim_rz(W[i,1], n_qubits - 1 - i)
 
                 # H S
                 file_content += ("h q[%d]; \n" % (n_qubits - 1 - i))
                 file_content += ("s q[%d]; \n" % (n_qubits - 1 - i))
 
                 # Rz(W[i,2])
-                try:
-                    multiple = round(float( W[i,2] / unit)) % frac
-                except:
-                    multiple = round(float( W[i,2]._value / unit)) % frac
-                for gate in precompile[multiple]:
-                    if gate == "Q":
-                        gate = "sdg"
-                    gate = gate.lower()
-                    file_content += ("%s q[%d]; \n" % (gate, n_qubits - 1 - i))
+                file_content += sliqsim_rz(W[i,2], n_qubits - 1 - i)
 
             for i in range(n_qubits - 1):
                 file_content += ("cx q[%d] q[%d]; \n" % (n_qubits - 1 - i, n_qubits - 2 - i))
@@ -111,7 +106,7 @@ def main(filename, n_qubits = None, n_layers = 6, n_iter = 60, unit = None, simu
             file.write(file_content)
 
         # execute
-        exe_result = os.popen("./SliQSim --sim_qasm circuit.qasm").read().split('\n')
+        exe_result = os.popen("./SliQSim --sim_qasm circuit.qasm" + ((" --rz_res %d" % (frac // 2)) if native_rz else "")).read().split('\n')
         for line in exe_result:
             if line.startswith("The expectation value is"):
                 result = float(line.split()[-1])
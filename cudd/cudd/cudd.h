@@ -745,6 +745,8 @@ extern DdNode * Cudd_bddNor(DdManager *dd, DdNode *f, DdNode *g);
 extern DdNode * Cudd_bddXor(DdManager *dd, DdNode *f, DdNode *g);
 extern DdNode * Cudd_bddXnor(DdManager *dd, DdNode *f, DdNode *g);
 extern DdNode * Cudd_bddXnorLimit(DdManager *dd, DdNode *f, DdNode *g, unsigned int limit);
+extern DdNode * Cudd_bddXor3(DdManager *dd, DdNode *f, DdNode *g, DdNode *h);
+extern DdNode * Cudd_bddMaj(DdManager *dd, DdNode *f, DdNode *g, DdNode *h);
 extern int Cudd_bddLeq(DdManager *dd, DdNode *f, DdNode *g);
 extern DdNode * Cudd_addBddThreshold(DdManager *dd, DdNode *f, CUDD_VALUE_TYPE value);
 extern DdNode * Cudd_addBddStrictThreshold(DdManager *dd, DdNode *f, CUDD_VALUE_TYPE value);
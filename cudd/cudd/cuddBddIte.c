@@ -604,6 +604,78 @@ Cudd_bddXnorLimit(
 } /* end of Cudd_bddXnorLimit */
 
 
+/**
+  @brief Computes the exclusive OR of three BDDs f, g and h.
+
+  @details This is the sum bit of a full adder.  The result is
+  computed in a single recursive pass that uses the computed table,
+  without building the intermediate f XOR g.
+
+  @return a pointer to the resulting %BDD if successful; NULL if the
+  intermediate result blows up.
+
+  @sideeffect None
+
+  @see Cudd_bddXor Cudd_bddMaj
+
+*/
+DdNode *
+Cudd_bddXor3(
+  DdManager * dd /**< manager */,
+  DdNode * f /**< first operand */,
+  DdNode * g /**< second operand */,
+  DdNode * h /**< third operand */)
+{
+    DdNode *res;
+
+    do {
+	dd->reordered = 0;
+	res = cuddBddXor3Recur(dd,f,g,h);
+    } while (dd->reordered == 1);
+    if (dd->errorCode == CUDD_TIMEOUT_EXPIRED && dd->timeoutHandler) {
+        dd->timeoutHandler(dd, dd->tohArg);
+    }
+    return(res);
+
+} /* end of Cudd_bddXor3 */
+
+
+/**
+  @brief Computes the majority function of three BDDs f, g and h.
+
+  @details This is the carry bit of a full adder, (f AND g) OR
+  (f AND h) OR (g AND h), computed in a single recursive pass that
+  uses the computed table.
+
+  @return a pointer to the resulting %BDD if successful; NULL if the
+  intermediate result blows up.
+
+  @sideeffect None
+
+  @see Cudd_bddXor3 Cudd_bddAnd Cudd_bddOr
+
+*/
+DdNode *
+Cudd_bddMaj(
+  DdManager * dd /**< manager */,
+  DdNode * f /**< first operand */,
+  DdNode * g /**< second operand */,
+  DdNode * h /**< third operand */)
+{
+    DdNode *res;
+
+    do {
+	dd->reordered = 0;
+	res = cuddBddMajRecur(dd,f,g,h);
+    } while (dd->reordered == 1);
+    if (dd->errorCode == CUDD_TIMEOUT_EXPIRED && dd->timeoutHandler) {
+        dd->timeoutHandler(dd, dd->tohArg);
+    }
+    return(res);
+
+} /* end of Cudd_bddMaj */
+
+
 /**
   @brief Checks whether f is less than or equal to g.
 
@@ -1203,6 +1275,255 @@ cuddBddXorRecur(
 } /* end of cuddBddXorRecur */
 
 
+/**
+  @brief Implements the recursive step of Cudd_bddXor3.
+
+  @details The three operands are made regular (the complement bits
+  are folded into the result) and sorted, so that all permutations
+  and phases of the same operands share one cache entry.
+
+  @return a pointer to the result is successful; NULL otherwise.
+
+  @sideeffect None
+
+  @see Cudd_bddXor3
+
+*/
+DdNode *
+cuddBddXor3Recur(
+  DdManager * manager,
+  DdNode * f,
+  DdNode * g,
+  DdNode * h)
+{
+    DdNode *fv, *fnv, *gv, *gnv, *hv, *hnv;
+    DdNode *one, *r, *t, *e, *tmp;
+    int topf, topg, toph, top, comple;
+    unsigned int index;
+
+    statLine(manager);
+    one = DD_ONE(manager);
+
+    /* Fold the complement bits into the result. */
+    comple = Cudd_IsComplement(f) ^ Cudd_IsComplement(g) ^ Cudd_IsComplement(h);
+    f = Cudd_Regular(f);
+    g = Cudd_Regular(g);
+    h = Cudd_Regular(h);
+
+    /* Terminal cases. */
+    if (f == g) return(Cudd_NotCond(h,comple));
+    if (f == h) return(Cudd_NotCond(g,comple));
+    if (g == h) return(Cudd_NotCond(f,comple));
+    if (f == one) return(cuddBddXorRecur(manager,g,Cudd_NotCond(h,!comple)));
+    if (g == one) return(cuddBddXorRecur(manager,f,Cudd_NotCond(h,!comple)));
+    if (h == one) return(cuddBddXorRecur(manager,f,Cudd_NotCond(g,!comple)));
+
+    /* Sort the operands to increase cache efficiency. */
+    if (f > g) { tmp = f; f = g; g = tmp; }
+    if (g > h) { tmp = g; g = h; h = tmp; }
+    if (f > g) { tmp = f; f = g; g = tmp; }
+
+    /* Check cache. */
+    r = cuddCacheLookup(manager, DD_BDD_XOR3_TAG, f, g, h);
+    if (r != NULL) return(Cudd_NotCond(r,comple));
+
+    checkWhetherToGiveUp(manager);
+
+    /* All operands are regular and non-constant. */
+    topf = manager->perm[f->index];
+    topg = manager->perm[g->index];
+    toph = manager->perm[h->index];
+    top = ddMin(topf,ddMin(topg,toph));
+    index = manager->invperm[top];
+
+    /* Compute cofactors. */
+    if (topf == top) {
+	fv = cuddT(f); fnv = cuddE(f);
+    } else {
+	fv = fnv = f;
+    }
+    if (topg == top) {
+	gv = cuddT(g); gnv = cuddE(g);
+    } else {
+	gv = gnv = g;
+    }
+    if (toph == top) {
+	hv = cuddT(h); hnv = cuddE(h);
+    } else {
+	hv = hnv = h;
+    }
+
+    t = cuddBddXor3Recur(manager, fv, gv, hv);
+    if (t == NULL) return(NULL);
+    cuddRef(t);
+
+    e = cuddBddXor3Recur(manager, fnv, gnv, hnv);
+    if (e == NULL) {
+	Cudd_IterDerefBdd(manager, t);
+	return(NULL);
+    }
+    cuddRef(e);
+
+    if (t == e) {
+	r = t;
+    } else {
+	if (Cudd_IsComplement(t)) {
+	    r = cuddUniqueInter(manager,(int)index,Cudd_Not(t),Cudd_Not(e));
+	    if (r == NULL) {
+		Cudd_IterDerefBdd(manager, t);
+		Cudd_IterDerefBdd(manager, e);
+		return(NULL);
+	    }
+	    r = Cudd_Not(r);
+	} else {
+	    r = cuddUniqueInter(manager,(int)index,t,e);
+	    if (r == NULL) {
+		Cudd_IterDerefBdd(manager, t);
+		Cudd_IterDerefBdd(manager, e);
+		return(NULL);
+	    }
+	}
+    }
+    cuddDeref(e);
+    cuddDeref(t);
+    cuddCacheInsert(manager, DD_BDD_XOR3_TAG, f, g, h, r);
+    return(Cudd_NotCond(r,comple));
+
+} /* end of cuddBddXor3Recur */
+
+
+/**
+  @brief Implements the recursive step of Cudd_bddMaj.
+
+  @details The majority function is symmetric and self-dual, so the
+  operands are sorted and the first one is made regular by
+  complementing all three operands and the result.
+
+  @return a pointer to the result is successful; NULL otherwise.
+
+  @sideeffect None
+
+  @see Cudd_bddMaj
+
+*/
+DdNode *
+cuddBddMajRecur(
+  DdManager * manager,
+  DdNode * f,
+  DdNode * g,
+  DdNode * h)
+{
+    DdNode *F, *G, *H, *fv, *fnv, *gv, *gnv, *hv, *hnv;
+    DdNode *one, *zero, *r, *t, *e, *tmp;
+    int topf, topg, toph, top, comple;
+    unsigned int index;
+
+    statLine(manager);
+    one = DD_ONE(manager);
+    zero = Cudd_Not(one);
+
+    /* Terminal cases. */
+    if (f == g || f == h) return(f);
+    if (g == h) return(g);
+    if (f == Cudd_Not(g)) return(h);
+    if (f == Cudd_Not(h)) return(g);
+    if (g == Cudd_Not(h)) return(f);
+    if (Cudd_IsConstant(g)) { tmp = f; f = g; g = tmp; }
+    if (Cudd_IsConstant(h)) { tmp = f; f = h; h = tmp; }
+    if (f == zero) return(cuddBddAndRecur(manager,g,h));
+    if (f == one) {
+	r = cuddBddAndRecur(manager,Cudd_Not(g),Cudd_Not(h));
+	if (r == NULL) return(NULL);
+	return(Cudd_Not(r));
+    }
+
+    /* Sort the operands to increase cache efficiency. */
+    if (Cudd_Regular(f) > Cudd_Regular(g)) { tmp = f; f = g; g = tmp; }
+    if (Cudd_Regular(g) > Cudd_Regular(h)) { tmp = g; g = h; h = tmp; }
+    if (Cudd_Regular(f) > Cudd_Regular(g)) { tmp = f; f = g; g = tmp; }
+
+    /* Make the first operand regular. */
+    comple = Cudd_IsComplement(f);
+    if (comple) {
+	f = Cudd_Not(f);
+	g = Cudd_Not(g);
+	h = Cudd_Not(h);
+    }
+
+    /* Check cache. */
+    r = cuddCacheLookup(manager, DD_BDD_MAJ_TAG, f, g, h);
+    if (r != NULL) return(Cudd_NotCond(r,comple));
+
+    checkWhetherToGiveUp(manager);
+
+    /* At this point f, g and h are not constant. */
+    F = f;
+    G = Cudd_Regular(g);
+    H = Cudd_Regular(h);
+    topf = manager->perm[F->index];
+    topg = manager->perm[G->index];
+    toph = manager->perm[H->index];
+    top = ddMin(topf,ddMin(topg,toph));
+    index = manager->invperm[top];
+
+    /* Compute cofactors. */
+    if (topf == top) {
+	fv = cuddT(F); fnv = cuddE(F);
+    } else {
+	fv = fnv = f;
+    }
+    if (topg == top) {
+	gv = Cudd_NotCond(cuddT(G),g != G);
+	gnv = Cudd_NotCond(cuddE(G),g != G);
+    } else {
+	gv = gnv = g;
+    }
+    if (toph == top) {
+	hv = Cudd_NotCond(cuddT(H),h != H);
+	hnv = Cudd_NotCond(cuddE(H),h != H);
+    } else {
+	hv = hnv = h;
+    }
+
+    t = cuddBddMajRecur(manager, fv, gv, hv);
+    if (t == NULL) return(NULL);
+    cuddRef(t);
+
+    e = cuddBddMajRecur(manager, fnv, gnv, hnv);
+    if (e == NULL) {
+	Cudd_IterDerefBdd(manager, t);
+	return(NULL);
+    }
+    cuddRef(e);
+
+    if (t == e) {
+	r = t;
+    } else {
+	if (Cudd_IsComplement(t)) {
+	    r = cuddUniqueInter(manager,(int)index,Cudd_Not(t),Cudd_Not(e));
+	    if (r == NULL) {
+		Cudd_IterDerefBdd(manager, t);
+		Cudd_IterDerefBdd(manager, e);
+		return(NULL);
+	    }
+	    r = Cudd_Not(r);
+	} else {
+	    r = cuddUniqueInter(manager,(int)index,t,e);
+	    if (r == NULL) {
+		Cudd_IterDerefBdd(manager, t);
+		Cudd_IterDerefBdd(manager, e);
+		return(NULL);
+	    }
+	}
+    }
+    cuddDeref(e);
+    cuddDeref(t);
+    cuddCacheInsert(manager, DD_BDD_MAJ_TAG, f, g, h, r);
+    return(Cudd_NotCond(r,comple));
+
+} /* end of cuddBddMajRecur */
+
+
 /*---------------------------------------------------------------------------*/
 /* Definition of static functions                                            */
 /*---------------------------------------------------------------------------*/
@@ -157,6 +157,8 @@
 #define DD_BDD_MAX_EXP_TAG			0x8a
 #define DD_VARS_SYMM_BEFORE_TAG			0x8e
 #define DD_VARS_SYMM_BETWEEN_TAG		0xa2
+#define DD_BDD_XOR3_TAG				0xa6
+#define DD_BDD_MAJ_TAG				0xaa
 
 /* Generator constants. */
 #define CUDD_GEN_CUBES 0
@@ -1080,6 +1082,8 @@ extern DdNode * cuddBddIteRecur(DdManager *dd, DdNode *f, DdNode *g, DdNode *h);
 extern DdNode * cuddBddIntersectRecur(DdManager *dd, DdNode *f, DdNode *g);
 extern DdNode * cuddBddAndRecur(DdManager *manager, DdNode *f, DdNode *g);
 extern DdNode * cuddBddXorRecur(DdManager *manager, DdNode *f, DdNode *g);
+extern DdNode * cuddBddXor3Recur(DdManager *manager, DdNode *f, DdNode *g, DdNode *h);
+extern DdNode * cuddBddMajRecur(DdManager *manager, DdNode *f, DdNode *g, DdNode *h);
 extern DdNode * cuddBddTransfer(DdManager *ddS, DdManager *ddD, DdNode *f);
 extern DdNode * cuddAddBddDoPattern(DdManager *dd, DdNode *f);
 extern int cuddInitCache(DdManager *unique, unsigned int cacheSize, unsigned int maxCacheSize);
@@ -0,0 +1,9 @@
+// c[0] is last written by q[0], which is 0 or 1, and both are measured at the end
+// expect: 0.5 0.5
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[2];
+creg c[1];
+h q[0];
+measure q[1] -> c[0];
+measure q[0] -> c[0];
@@ -0,0 +1,10 @@
+// c[0] is last written by q[1], which is 0; the swap then moves q[0]
+// expect: 1 0
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[2];
+creg c[1];
+h q[0];
+measure q[0] -> c[0];
+measure q[1] -> c[0];
+swap q[1],q[0];
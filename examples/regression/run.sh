@@ -0,0 +1,17 @@
+#!/bin/sh
+# Simulate each circuit here in probability mode and compare the distribution
+# with its "// expect:" line. Usage: run.sh [path to SliQSim]
+exe=${1:-./SliQSim}
+dir=$(dirname "$0")
+fail=0
+for f in "$dir"/*.qasm; do
+    expect=$(sed -n 's|^// expect: ||p' "$f")
+    got=$("$exe" --sim_qasm "$f" --type 2 | sed -n 's/.*\[\(.*\)\].*/\1/p' | tr ',' ' ')
+    if echo "$expect | $got" | awk -F'|' '{ n = split($1, e, " "); if (split($2, g, " ") != n) exit 1; for (i = 1; i <= n; i++) if ((e[i] - g[i]) ^ 2 > 1e-18) exit 1 }'; then
+        echo "ok   $f"
+    else
+        echo "FAIL $f: expected $expect, got $got"
+        fail=1
+    fi
+done
+exit $fail
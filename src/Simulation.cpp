@@ -1,5 +1,15 @@
 #include "Simulator.h"
 #include "util_sim.h"
+#include <algorithm>
+#include <cstring> // memchr
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // ftruncate
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 
 /**Function*************************************************************
@@ -20,8 +30,9 @@ void Simulator::init_simulator(int nQubits)
 
     int *constants = new int[n];
     for (int i = 0; i < n; i++)
-        constants[i] = 0; // TODO: custom initial state
+        constants[i] = 0; // |0...0>, replaced by a later init or initial_state
     measured_qubits_to_clbits = std::vector<std::vector<int>>(n, std::vector<int>(0));
+    clbit_writer.clear();
 
     // Initialize the state
     init_state(constants);
@@ -33,313 +44,1273 @@ void Simulator::init_simulator(int nQubits)
 
 /**Function*************************************************************
 
-  Synopsis    [parse and simulate the qasm file]
+  Synopsis    [Cut the next line of the buffer]
+
+  Description [[first, last) is set to the line without its comment and
+               surrounding whitespace, pos to the start of the next line.
+               Returns false at the end of the buffer.]
+
+  SideEffects []
+
+  SeeAlso     [compile_qasm]
+
+***********************************************************************/
+static bool next_line(const char *&pos, const char *end, const char *&first, const char *&last)
+{
+    if (pos >= end)
+        return false;
+    const char *eol = (const char *) memchr(pos, '\n', end - pos);
+    if (eol == NULL)
+        eol = end;
+    first = pos;
+    last = eol;
+    for (const char *c = first; c + 1 < last; c++)
+        if (c[0] == '/' && c[1] == '/')
+        {
+            last = c;
+            break;
+        }
+    while (first < last && isspace((unsigned char) *first))
+        first++;
+    while (last > first && isspace((unsigned char) last[-1]))
+        last--;
+    pos = eol + 1;
+    return true;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Opcode of a gate token, -1 if it is not a gate]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [compile_qasm]
+
+***********************************************************************/
+static int gate_opcode(const std::string &gate)
+{
+    if (gate == "x") return OP_X;
+    if (gate == "y") return OP_Y;
+    if (gate == "z") return OP_Z;
+    if (gate == "h") return OP_H;
+    if (gate == "s") return OP_S;
+    if (gate == "sdg") return OP_SDG;
+    if (gate == "t") return OP_T;
+    if (gate == "tdg") return OP_TDG;
+    if (gate == "rx(pi/2)") return OP_RX;
+    if (gate == "ry(pi/2)") return OP_RY;
+    if (gate.compare(0, 3, "rz(") == 0) return OP_RZ;
+    if (gate.compare(0, 3, "u1(") == 0 || gate.compare(0, 2, "p(") == 0) return OP_U1;
+    if (gate == "cx") return OP_CX;
+    if (gate == "cz") return OP_CZ;
+    if (gate == "swap") return OP_SWAP;
+    if (gate == "cswap") return OP_CSWAP;
+    if (gate == "ccx" || gate == "mcx") return OP_MCX;
+    return -1;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Read an amplitude line of initial_state, e.g. 0.5-0.5i]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [compile_qasm]
+
+***********************************************************************/
+static void parse_amplitude(const std::string &inStr, double &real_part, double &imag_part)
+{
+    // Get the real and imaginary part
+    std::string doubleStr;
+    std::stringstream inDouble_ss(inStr);
+    bool use_minus_delimiter = false;
+    bool neg_real = false, neg_imag = false;
+
+    // Determine whether the real or imaginary part is negative
+    if (inStr[0] == '-')
+    {
+        neg_real = true;
+        inDouble_ss.str(inStr.substr(1));
+    }
+    else if (inStr[0] == '+')
+    {
+        inDouble_ss.str(inStr.substr(1));
+    }
+    if (inDouble_ss.str().find_first_of('-') != std::string::npos)
+    {
+        use_minus_delimiter = true;
+        neg_imag = true;
+    }
+
+    // Split the string to obtain the real and imaginary part
+    if (use_minus_delimiter)
+        getline(inDouble_ss, doubleStr, '-');
+    else
+        getline(inDouble_ss, doubleStr, '+');
+    real_part = (neg_real)? -stod(doubleStr) : stod(doubleStr);
+    getline(inDouble_ss, doubleStr, 'i');
+    imag_part = (neg_imag)? -stod(doubleStr) : stod(doubleStr);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Add an amplitude to an initial state]
+
+  Description [Both parts are rounded to multiples of
+               2^-INITIAL_STATE_PRECISION; amplitudes rounded to 0 are
+               left out.]
+
+  SideEffects []
+
+  SeeAlso     [compile_qasm]
+
+***********************************************************************/
+static void add_amplitude(InitialState &state, unsigned long long index, double real_part, double imag_part)
+{
+    int re = int(std::round(real_part * pow(2, INITIAL_STATE_PRECISION)));
+    int im = int(std::round(imag_part * pow(2, INITIAL_STATE_PRECISION)));
+    if (re == 0 && im == 0)
+        return;
+    state.index.push_back(index);
+    state.value.push_back(re);
+    state.value.push_back(im);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Read an initial state from a .npy file]
+
+  Description [The array holds the 2^n amplitudes as complex128 or
+               float64, entry i for the basis state where qubit q is bit q
+               of i, as written by --statevector_file.]
+
+  SideEffects []
+
+  SeeAlso     [compile_qasm]
+
+***********************************************************************/
+static void read_npy_state(const std::string &path, int nQubits, InitialState &state)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        std::cerr << "[error]Cannot open the initial state file " << path << std::endl;
+        std::exit(1);
+    }
+    void *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "[error]Cannot map the initial state file " << path << std::endl;
+        std::exit(1);
+    }
+
+    // magic, version, header length, then a dict such as {'descr': '<c16', 'fortran_order': False, 'shape': (8,), }
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t start = 0;
+    std::string header;
+    if (st.st_size >= 12 && memcmp(bytes, "\x93NUMPY", 6) == 0)
+    {
+        size_t length = (bytes[6] == 1) ? bytes[8] | bytes[9] << 8 : bytes[8] | bytes[9] << 8 | bytes[10] << 16 | (size_t) bytes[11] << 24;
+        start = ((bytes[6] == 1) ? 10 : 12) + length;
+        if (start <= st.st_size)
+            header.assign((const char *) bytes + start - length, length);
+    }
+    size_t descr = header.find("'descr'"), shape = header.find("'shape'");
+    bool isComplex = descr != std::string::npos && header.compare(header.find('\'', descr + 7) + 1, 4, "<c16") == 0;
+    bool isReal = descr != std::string::npos && header.compare(header.find('\'', descr + 7) + 1, 3, "<f8") == 0;
+    unsigned long long nEntries = (shape == std::string::npos) ? 0 : strtoull(header.c_str() + header.find('(', shape) + 1, NULL, 10);
+    if ((!isComplex && !isReal) || header.find("'fortran_order': True") != std::string::npos
+        || nEntries != (1ULL << nQubits) || start + nEntries * (isComplex ? 16 : 8) > st.st_size)
+    {
+        std::cerr << "[error]The initial state file " << path << " is not a .npy array of " << (1ULL << nQubits) << " complex128 or float64" << std::endl;
+        std::exit(1);
+    }
+
+    const char *entries = (const char *) bytes + start;
+    for (unsigned long long i = 0; i < nEntries; i++)
+    {
+        double amp[2] = {0, 0};
+        memcpy(amp, entries + i * (isComplex ? 16 : 8), isComplex ? 16 : 8);
+        add_amplitude(state, i, amp[0], amp[1]);
+    }
+    munmap(data, st.st_size);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Compile the qasm text in [begin, end) into code]
+
+  Description [One pass over the buffer, which is only read: each line
+               becomes an opcode and its bracketed integers in
+               code.operands. qreg and creg also set the register sizes
+               of code, the amplitudes following initial_state go to
+               code.states and exp_val and exp_term lines are kept for
+               parse_expval. An h right after qreg starts an init plus
+               that takes the following h on higher qubits, so the usual
+               first layer of h gates only builds the state once.
+               No member of the simulator is written, so
+               a thread can compile while another one simulates.
+               Unless isLast, an initial_state whose amplitudes do not
+               all lie in the buffer is left out, and the start of its
+               line is returned for the next piece of text; otherwise
+               returns end.]
+
+  SideEffects []
+
+  SeeAlso     [run_circuit sim_qasm_stream]
+
+***********************************************************************/
+const char *Simulator::compile_qasm(const char *begin, const char *end, CircuitCode &code, bool isLast)
+{
+    const char *pos = begin, *first, *last;
+    while (next_line(pos, end, first, last))
+    {
+        if (first == last)
+            continue;
+        const char *line = first;
+        const char *cut = first;
+        while (cut < last && *cut != ' ' && *cut != '\t')
+            cut++;
+        std::string token(first, cut); // short enough to stay on the stack
+
+        if (token == "OPENQASM" || token == "include")
+            continue;
+        if (token == "exp_val" || token == "exp_term")
+        {
+            code.expvals.push_back(std::make_pair(token, std::string(cut < last ? cut + 1 : last, last)));
+            continue;
+        }
+
+        CircuitOp op;
+        op.m = 0;
+        op.start = code.operands.size();
+        for (const char *c = cut; c < last; c++)
+            if (*c == '[')
+            {
+                int value = 0;
+                while (c + 1 < last && isdigit((unsigned char) c[1]))
+                    value = value * 10 + (*++c - '0');
+                code.operands.push_back(value);
+            }
+        op.count = code.operands.size() - op.start;
+
+        int nOperands = 1; // -1 if any
+        if (token == "creg")
+        {
+            code.nClbits = op.count ? code.operands[op.start] : 0;
+            code.operands.resize(op.start);
+            continue;
+        }
+        else if (token == "qreg")
+        {
+            op.code = OP_QREG;
+            code.nQubits = op.count ? code.operands[op.start] : 0;
+        }
+        else if (token == "measure")
+        {
+            op.code = OP_MEASURE;
+            nOperands = 2;
+        }
+        else if (token == "rus")
+        {
+            op.code = OP_RUS;
+            nOperands = (op.count % 2 == 0) ? -1 : 0;
+        }
+        else if (token == "initial_state")
+        {
+            op.code = OP_INITIAL_STATE;
+            op.m = code.states.size();
+            nOperands = -1;
+            if (code.nQubits > 64)
+            {
+                std::cerr << "[error]initial_state supports at most 64 qubits" << std::endl;
+                std::exit(1);
+            }
+
+            // initial_state: 2^n amplitudes, initial_state sparse <m>: m lines of index, real and imaginary part,
+            // initial_state <file>: a .npy array of 2^n amplitudes
+            char *arg_end;
+            const char *arg = cut;
+            while (arg < last && (isspace((unsigned char) *arg) || *arg == '"'))
+                arg++;
+            const char *arg_last = arg;
+            while (arg_last < last && !isspace((unsigned char) *arg_last) && *arg_last != '"' && *arg_last != ';')
+                arg_last++;
+            std::string argStr(arg, arg_last);
+            bool isSparse = (argStr == "sparse");
+            InitialState state;
+            if (argStr.empty() || isSparse)
+            {
+                unsigned long long nLines = isSparse ? strtoull(arg_last, &arg_end, 10) : 1ULL << code.nQubits;
+                for (unsigned long long i = 0; i < nLines; i++)
+                {
+                    // Read the coefficient of the i-th basis state
+                    if (!next_line(pos, end, first, last))
+                    {
+                        if (!isLast)
+                        {
+                            code.operands.resize(op.start);
+                            return line;
+                        }
+                        std::cerr << "[error]initial_state expects " << nLines << " amplitudes, found " << i << std::endl;
+                        std::exit(1);
+                    }
+                    unsigned long long index = i;
+                    double real_part, imag_part;
+                    if (isSparse)
+                    {
+                        std::string inStr(first, last);
+                        for (int c = 0; c < inStr.size(); c++)
+                            if (inStr[c] == ',' || inStr[c] == '(' || inStr[c] == ')')
+                                inStr[c] = ' ';
+                        std::stringstream inStr_ss(inStr);
+                        if (!(inStr_ss >> index >> real_part >> imag_part) || (code.nQubits < 64 && index >> code.nQubits))
+                        {
+                            std::cerr << "[error]Wrong amplitude \'" << std::string(first, last) << "\' of initial_state" << std::endl;
+                            std::exit(1);
+                        }
+                    }
+                    else
+                        parse_amplitude(std::string(first, last), real_part, imag_part);
+                    add_amplitude(state, index, real_part, imag_part);
+                }
+            }
+            else
+            {
+                read_npy_state(argStr, code.nQubits, state);
+                code.isExternal = true;
+            }
+            code.states.push_back(state);
+        }
+        else if (token == "init")
+        {
+            // init plus|basis [q[i], ...]: |+> or |1> on the listed qubits (plus: all if none) and |0> on the others,
+            // init ghz, init w, init dicke <k>
+            const char *arg = cut;
+            while (arg < last && isspace((unsigned char) *arg))
+                arg++;
+            const char *arg_last = arg;
+            while (arg_last < last && isalpha((unsigned char) *arg_last))
+                arg_last++;
+            std::string argStr(arg, arg_last);
+            nOperands = 0;
+            if (argStr == "plus")
+            {
+                op.code = OP_INIT_PLUS;
+                if (op.count == 0)
+                    for (int q = 0; q < code.nQubits; q++)
+                        code.operands.push_back(q);
+                op.count = code.operands.size() - op.start;
+                nOperands = -1;
+            }
+            else if (argStr == "basis")
+            {
+                op.code = OP_INIT_BASIS;
+                nOperands = -1;
+            }
+            else if (argStr == "ghz")
+                op.code = OP_INIT_GHZ;
+            else if (argStr == "w")
+            {
+                op.code = OP_INIT_DICKE;
+                op.m = 1;
+            }
+            else if (argStr == "dicke")
+            {
+                char *arg_end;
+                op.code = OP_INIT_DICKE;
+                op.m = strtol(arg_last, &arg_end, 10);
+                if (arg_end == arg_last || op.m < 0 || op.m > code.nQubits)
+                {
+                    std::cerr << "[error]Wrong weight in \'" << std::string(first, last) << "\'" << std::endl;
+                    std::exit(1);
+                }
+            }
+            else
+            {
+                std::cerr << "[error]Unknown state \'" << argStr << "\' of init" << std::endl;
+                std::exit(1);
+            }
+        }
+        else if ((op.code = gate_opcode(token)) >= 0)
+        {
+            if (op.code == OP_RZ)
+                op.m = angle_multiple(token, PI / res);
+            else if (op.code == OP_U1)
+                op.m = angle_multiple(token, PI / w);
+            if (op.code == OP_CX || op.code == OP_CZ || op.code == OP_SWAP)
+                nOperands = 2;
+            else if (op.code == OP_CSWAP)
+                nOperands = 3;
+            else if (op.code == OP_MCX)
+                nOperands = op.count ? -1 : 0;
+        }
+        else
+        {
+            std::cerr << std::endl
+                    << "[warning]: Syntax \'" << token << "\' is not supported in this simulator. The line is ignored ..." << std::endl;
+            code.operands.resize(op.start);
+            continue;
+        }
+        if (nOperands >= 0 && op.count != nOperands)
+        {
+            std::cerr << "[error]Wrong number of operands in \'" << std::string(first, last) << "\'" << std::endl;
+            std::exit(1);
+        }
+        // qubits come first among the operands; the others are the qreg size, clbits of measure and conditions of rus
+        int nQubitOperands = (op.code == OP_QREG) ? 0 : (op.code == OP_MEASURE) ? 1 : (op.code == OP_RUS) ? op.count / 2 : op.count;
+        for (int i = op.start; i < op.start + nQubitOperands; i++)
+            if (code.operands[i] >= code.nQubits)
+            {
+                std::cerr << "[error]Qubit " << code.operands[i] << " out of range in \'" << std::string(first, last) << "\'" << std::endl;
+                std::exit(1);
+            }
+        // h on |0> right after qreg becomes an init plus, and a following h on a higher qubit joins it;
+        // an init plus written in the text is left as it is
+        if (op.code == OP_H && !code.ops.empty())
+        {
+            CircuitOp &prev = code.ops.back();
+            if (prev.code == OP_QREG)
+            {
+                op.code = OP_INIT_PLUS;
+                op.m = 1;
+            }
+            else if (prev.code == OP_INIT_PLUS && prev.m == 1 && prev.start + prev.count == op.start
+                     && code.operands[op.start - 1] < code.operands[op.start])
+            {
+                prev.count++;
+                continue;
+            }
+        }
+        code.ops.push_back(op);
+    }
+    return end;
+}
+
+// header of a compiled circuit file, followed by the ops, the operands, the
+// initial states (count, indices, values), the exp_val weights and the Pauli strings
+struct CircuitHeader
+{
+    char magic[4]; // "SQSC"
+    int version;
+    int res, n, nClbits, nStates, nTerms, reserved;
+    unsigned long long hash, size; // of the qasm text
+    unsigned long long nOps, nOperands, nAmplitudes; // nAmplitudes over all initial states
+};
+static const int CIRCUIT_VERSION = 3;
+
+/**Function*************************************************************
+
+  Synopsis    [64-bit FNV-1a hash of the qasm text]
+
+  Description [seed is mixed in first, so the same text compiled with
+               another resolution has another key.]
+
+  SideEffects []
+
+  SeeAlso     [sim_qasm]
+
+***********************************************************************/
+static unsigned long long qasm_hash(const char *begin, const char *end, int seed)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = (hash ^ (unsigned) seed) * 1099511628211ULL;
+    for (const char *c = begin; c < end; c++)
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    return hash;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Byte size of a compiled circuit file]
 
   Description []
 
   SideEffects []
 
+  SeeAlso     [load_circuit save_circuit]
+
+***********************************************************************/
+static unsigned long long circuit_file_size(const CircuitHeader &header)
+{
+    return sizeof(CircuitHeader) + header.nOps * sizeof(CircuitOp) + header.nOperands * sizeof(int)
+        + header.nStates * sizeof(unsigned long long) + header.nAmplitudes * (sizeof(unsigned long long) + 2 * sizeof(int))
+        + header.nTerms * (sizeof(double) + header.n);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Read Circuit back from a compiled circuit file]
+
+  Description [Returns false, leaving the circuit empty, if the file is
+               missing or was compiled from another text, resolution or
+               format version.]
+
+  SideEffects []
+
+  SeeAlso     [save_circuit]
+
+***********************************************************************/
+bool Simulator::load_circuit(const std::string &path, unsigned long long hash, unsigned long long size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CircuitHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    CircuitHeader header;
+    memcpy(&header, data, sizeof(CircuitHeader));
+    bool isValid = memcmp(header.magic, "SQSC", 4) == 0 && header.version == CIRCUIT_VERSION
+        && header.hash == hash && header.size == size && header.res == res
+        && circuit_file_size(header) == (unsigned long long) st.st_size;
+    if (isValid)
+    {
+        const char *pos = (const char *) data + sizeof(CircuitHeader);
+        n = header.n;
+        nClbits = header.nClbits;
+        Circuit.ops.resize(header.nOps);
+        memcpy(Circuit.ops.data(), pos, header.nOps * sizeof(CircuitOp));
+        pos += header.nOps * sizeof(CircuitOp);
+        Circuit.operands.resize(header.nOperands);
+        memcpy(Circuit.operands.data(), pos, header.nOperands * sizeof(int));
+        pos += header.nOperands * sizeof(int);
+        Circuit.states.assign(header.nStates, InitialState());
+        unsigned long long nAmplitudes = header.nAmplitudes;
+        for (int i = 0; i < header.nStates; i++)
+        {
+            unsigned long long count;
+            memcpy(&count, pos, sizeof(count));
+            pos += sizeof(count);
+            count = std::min(count, nAmplitudes); // only a damaged file differs
+            nAmplitudes -= count;
+            Circuit.states[i].index.resize(count);
+            memcpy(Circuit.states[i].index.data(), pos, count * sizeof(unsigned long long));
+            pos += count * sizeof(unsigned long long);
+            Circuit.states[i].value.resize(2 * count);
+            memcpy(Circuit.states[i].value.data(), pos, 2 * count * sizeof(int));
+            pos += 2 * count * sizeof(int);
+        }
+        expval_terms.resize(header.nTerms);
+        for (int t = 0; t < header.nTerms; t++)
+        {
+            memcpy(&expval_terms[t].first, pos, sizeof(double));
+            pos += sizeof(double);
+        }
+        for (int t = 0; t < header.nTerms; t++)
+        {
+            expval_terms[t].second.assign(pos, n);
+            pos += n;
+        }
+    }
+    munmap(data, st.st_size);
+    return isValid;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Write Circuit to a compiled circuit file]
+
+  Description [The file is written under a temporary name and renamed,
+               so concurrent runs never read a partial file. A failure
+               only costs the cache, so it is a warning.]
+
+  SideEffects []
+
+  SeeAlso     [load_circuit]
+
+***********************************************************************/
+void Simulator::save_circuit(const std::string &path, unsigned long long hash, unsigned long long size)
+{
+    CircuitHeader header;
+    memcpy(header.magic, "SQSC", 4);
+    header.version = CIRCUIT_VERSION;
+    header.res = res;
+    header.n = n;
+    header.nClbits = nClbits;
+    header.nStates = Circuit.states.size();
+    header.nTerms = expval_terms.size();
+    header.reserved = 0;
+    header.hash = hash;
+    header.size = size;
+    header.nOps = Circuit.ops.size();
+    header.nOperands = Circuit.operands.size();
+    header.nAmplitudes = 0;
+    for (int i = 0; i < Circuit.states.size(); i++)
+        header.nAmplitudes += Circuit.states[i].index.size();
+    unsigned long long fileSize = circuit_file_size(header);
+
+    std::string tmp = path + "." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    void *data = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, fileSize) == 0)
+        data = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cout << "Warning: cannot write the compiled circuit " << path << ".\n" << std::flush;
+        unlink(tmp.c_str());
+        return;
+    }
+
+    char *pos = (char *) data;
+    memcpy(pos, &header, sizeof(CircuitHeader));
+    pos += sizeof(CircuitHeader);
+    memcpy(pos, Circuit.ops.data(), Circuit.ops.size() * sizeof(CircuitOp));
+    pos += Circuit.ops.size() * sizeof(CircuitOp);
+    memcpy(pos, Circuit.operands.data(), Circuit.operands.size() * sizeof(int));
+    pos += Circuit.operands.size() * sizeof(int);
+    for (int i = 0; i < Circuit.states.size(); i++)
+    {
+        unsigned long long count = Circuit.states[i].index.size();
+        memcpy(pos, &count, sizeof(count));
+        pos += sizeof(count);
+        memcpy(pos, Circuit.states[i].index.data(), count * sizeof(unsigned long long));
+        pos += count * sizeof(unsigned long long);
+        memcpy(pos, Circuit.states[i].value.data(), 2 * count * sizeof(int));
+        pos += 2 * count * sizeof(int);
+    }
+    for (int t = 0; t < expval_terms.size(); t++)
+    {
+        memcpy(pos, &expval_terms[t].first, sizeof(double));
+        pos += sizeof(double);
+    }
+    for (int t = 0; t < expval_terms.size(); t++)
+    {
+        std::string term = expval_terms[t].second;
+        term.resize(n, 'I');
+        memcpy(pos, term.data(), n);
+        pos += n;
+    }
+    munmap(data, fileSize);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::cout << "Warning: cannot write the compiled circuit " << path << ".\n" << std::flush;
+        unlink(tmp.c_str());
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Simulate the compiled circuit]
+
+  Description [A measurement is deferred to the end of the circuit, where
+               all shots are drawn from the final state, unless a later
+               instruction acts on the measured qubit. There the run
+               branches on the outcomes, each with its share of the shots,
+               and the instructions up to the next such one are simulated
+               once per branch instead of once per shot. The run starts
+               at instruction pc.]
+
+  SideEffects []
+
+  SeeAlso     [run_circuit split_branches]
+
+***********************************************************************/
+void Simulator::sim_circuit(int pc)
+{
+    std::vector<int> qubits;
+
+    // the outcomes no shot reaches are kept for the exact distribution and for expectation values
+    bool isAll = (sim_type == 2) || (sim_type == 0 && !expval_terms.empty());
+
+    pc = run_circuit(pc, qubits);
+    while (pc < Circuit.ops.size())
+    {
+        split_branches(qubits, isAll);
+        int next = Circuit.ops.size();
+        for (int b = 0; b < branches.size(); b++)
+        {
+            load_branch(branches[b]);
+            next = run_circuit(pc, qubits);
+            store_branch(branches[b]);
+        }
+        pc = next;
+    }
+    if (!branches.empty())
+        merge_branches();
+    if (isReorder) Cudd_AutodynDisable(manager);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Whether an instruction acts on a qubit with a pending
+               measurement]
+
+  Description [qubits is set to such qubits of the instruction. The
+               condition values of rus are not qubits; initial_state
+               replaces every qubit.]
+
+  SideEffects []
+
+  SeeAlso     [run_circuit]
+
+***********************************************************************/
+bool Simulator::measured_op(const CircuitOp &op, std::vector<int> &qubits)
+{
+    qubits.clear();
+    if (op.code == OP_QREG || op.code == OP_MEASURE)
+        return false;
+
+    if (op.code >= OP_INITIAL_STATE && op.code <= OP_INIT_DICKE) // replaces the state
+    {
+        for (int q = 0; q < n; q++)
+            if (!measured_qubits_to_clbits[q].empty())
+                qubits.push_back(q);
+        return !qubits.empty();
+    }
+    int count = (op.code == OP_RUS) ? op.count / 2 : op.count;
+    for (int i = op.start; i < op.start + count; i++)
+    {
+        int q = Circuit.operands[i];
+        if (q >= 0 && q < n && !measured_qubits_to_clbits[q].empty()
+            && std::find(qubits.begin(), qubits.end(), q) == qubits.end())
+            qubits.push_back(q);
+    }
+    return !qubits.empty();
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Execute Circuit from instruction pc]
+
+  Description [Stops before an instruction acting on a qubit with a
+               pending measurement and returns its index, with qubits
+               set; returns Circuit.ops.size() at the end. The pending gates
+               are applied either way.]
+
+  SideEffects []
+
+  SeeAlso     [sim_circuit measured_op]
+
+***********************************************************************/
+int Simulator::run_circuit(int pc, std::vector<int> &qubits)
+{
+    for (; pc < Circuit.ops.size(); pc++)
+    {
+        const CircuitOp &op = Circuit.ops[pc];
+        const int *q = Circuit.operands.data() + op.start;
+        if (isMeasure && measured_op(op, qubits))
+            break;
+        if (!is_buffered_op(op.code))
+            flush_gates();
+        switch (op.code)
+        {
+        case OP_QREG:
+            init_simulator(q[0]);
+            break;
+        case OP_MEASURE:
+            isMeasure = 1;
+            measure(q[0], q[1]);
+            break;
+        case OP_INITIAL_STATE:
+            init_state_by_matrix(INITIAL_STATE_PRECISION * 2, Circuit.states[op.m]);
+            break;
+        case OP_INIT_PLUS:
+        case OP_INIT_BASIS:
+        case OP_INIT_GHZ:
+        case OP_INIT_DICKE:
+            init_state_by_op(op);
+            break;
+        case OP_RUS:
+            RUS(std::vector<int>(q, q + op.count / 2), std::vector<int>(q + op.count / 2, q + op.count));
+            break;
+        case OP_X:
+            gate1({GATE_X, 0, 0}, q[0]);
+            break;
+        case OP_Y:
+            gate1({GATE_Y, 0, 0}, q[0]);
+            break;
+        case OP_Z:
+            gate1({GATE_PHASE, 0, w}, q[0]);
+            break;
+        case OP_H:
+            gate1({GATE_H, 0, 0}, q[0]);
+            break;
+        case OP_S:
+            gate1({GATE_PHASE, 0, w / 2}, q[0]);
+            break;
+        case OP_SDG:
+            gate1({GATE_PHASE, 0, -w / 2}, q[0]);
+            break;
+        case OP_T:
+            gate1({GATE_PHASE, 0, w / 4}, q[0]);
+            break;
+        case OP_TDG:
+            gate1({GATE_PHASE, 0, -w / 4}, q[0]);
+            break;
+        case OP_RX:
+            gate1({GATE_RX, 0, 0}, q[0]);
+            break;
+        case OP_RY:
+            gate1({GATE_RY, 0, 0}, q[0]);
+            break;
+        case OP_RZ:
+            gate1({GATE_PHASE, -op.m, op.m}, q[0]);
+            break;
+        case OP_U1:
+            gate1({GATE_PHASE, 0, op.m}, q[0]);
+            break;
+        case OP_CX:
+            block_toffoli(q[1], std::vector<int>(1, q[0]));
+            break;
+        case OP_CZ:
+            block_phase_gate(std::vector<int>(q, q + 2), w);
+            break;
+        case OP_SWAP:
+            block_swap(q[0], q[1], std::vector<int>(0));
+            break;
+        case OP_CSWAP:
+            block_swap(q[1], q[2], std::vector<int>(1, q[0]));
+            break;
+        case OP_MCX:
+            block_toffoli(q[op.count - 1], std::vector<int>(q, q + op.count - 1));
+            break;
+        }
+    }
+    flush_gates();
+    return pc;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Keep only the backward lightcone of the observed qubits]
+
+  Description [Applies when the expectation value is the only output:
+               sampling mode without measure, initial_state, an entangled
+               init, rus or queries.
+               Instructions are scanned from the end; a gate is kept if
+               it touches the cone, and its qubits then join the cone.
+               init plus and init basis give a product state, so they
+               are kept with the qubits of the cone only.
+               The qubits of the cone are renumbered in order, in the
+               operands and in the Pauli strings, so the manager only
+               holds those.]
+
+  SideEffects []
+
+  SeeAlso     [sim_qasm]
+
+***********************************************************************/
+void Simulator::lightcone()
+{
+    if (sim_type != 0 || !query_states.empty() || expval_terms.empty())
+        return;
+
+    int nQubits = 0;
+    for (int i = 0; i < Circuit.ops.size(); i++)
+    {
+        if (Circuit.ops[i].code == OP_MEASURE || Circuit.ops[i].code == OP_INITIAL_STATE || Circuit.ops[i].code == OP_INIT_GHZ
+            || Circuit.ops[i].code == OP_INIT_DICKE || Circuit.ops[i].code == OP_RUS)
+            return;
+        if (Circuit.ops[i].code == OP_QREG)
+            nQubits = Circuit.operands[Circuit.ops[i].start];
+    }
+
+    std::vector<bool> inCone(nQubits, false);
+    bool isObserved = false;
+    for (int t = 0; t < expval_terms.size(); t++)
+        for (int q = 0; q < nQubits && q < expval_terms[t].second.size(); q++)
+            if (expval_terms[t].second[q] != 'I')
+                inCone[q] = isObserved = true;
+    if (!isObserved)
+        return;
+
+    std::vector<bool> isKept(Circuit.ops.size(), true);
+    bool isPruned = false;
+    for (int i = Circuit.ops.size() - 1; i >= 0; i--)
+    {
+        const CircuitOp &op = Circuit.ops[i];
+        if (op.code == OP_QREG || op.code == OP_INIT_PLUS || op.code == OP_INIT_BASIS)
+            continue;
+        bool touch = false;
+        for (int j = op.start; j < op.start + op.count; j++)
+            touch |= inCone[Circuit.operands[j]];
+        if (touch)
+            for (int j = op.start; j < op.start + op.count; j++)
+                inCone[Circuit.operands[j]] = true;
+        else
+        {
+            isKept[i] = false;
+            isPruned = true;
+        }
+    }
+
+    std::vector<int> index(nQubits, 0);
+    int nCone = 0;
+    for (int q = 0; q < nQubits; q++)
+        if (inCone[q])
+            index[q] = nCone++;
+    if (!isPruned && nCone == nQubits)
+        return;
+
+    std::vector<CircuitOp> pruned;
+    for (int i = 0; i < Circuit.ops.size(); i++)
+    {
+        if (!isKept[i])
+            continue;
+        CircuitOp op = Circuit.ops[i];
+        if (op.code == OP_INIT_PLUS || op.code == OP_INIT_BASIS)
+        {
+            int count = 0;
+            for (int j = op.start; j < op.start + op.count; j++)
+                if (inCone[Circuit.operands[j]])
+                    Circuit.operands[op.start + count++] = index[Circuit.operands[j]];
+            op.count = count;
+        }
+        else
+            for (int j = op.start; j < op.start + op.count; j++)
+                Circuit.operands[j] = (op.code == OP_QREG) ? nCone : index[Circuit.operands[j]];
+        pruned.push_back(op);
+    }
+    Circuit.ops.swap(pruned);
+    for (int t = 0; t < expval_terms.size(); t++)
+    {
+        std::string term(nCone, 'I');
+        for (int q = 0; q < nQubits; q++)
+            if (inCone[q])
+                term[index[q]] = expval_terms[t].second[q];
+        expval_terms[t].second = term;
+    }
+    n = nCone;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Parse an exp_val or exp_term line into expval_terms]
+
+  Description [exp_val q[i] ...; multiplies into one Pauli string of
+               weight 1 shared by all exp_val lines. exp_term <weight>
+               [P] q[i] ...; adds a weighted Pauli string, where P is one
+               of I, X, Y, Z (Z if omitted); no qubit is the identity. Each
+               term holds one letter per qubit, 'I' where it acts
+               trivially.]
+
+  SideEffects []
+
+  SeeAlso     [getExpectVal]
+
+***********************************************************************/
+void Simulator::parse_expval(std::string keyword, std::stringstream &inStr_ss)
+{
+    std::string inStr;
+    bool isWeighted = (keyword == "exp_term");
+    if (isWeighted)
+    {
+        getline(inStr_ss, inStr, ' ');
+        expval_terms.push_back(std::make_pair(stod(inStr), std::string(n, 'I')));
+    }
+    else if (expval_index < 0)
+    {
+        expval_index = expval_terms.size();
+        expval_terms.push_back(std::make_pair(1.0, std::string(n, 'I')));
+    }
+    std::string &term = isWeighted ? expval_terms.back().second : expval_terms[expval_index].second;
+
+    std::string prefix;
+    getline(inStr_ss, prefix, '[');
+    while (getline(inStr_ss, inStr, ']'))
+    {
+        int qubit = stoi(inStr);
+        assert((qubit >= 0) & (qubit < n));
+        char pauli = 'Z';
+        std::stringstream prefix_ss(prefix);
+        while (prefix_ss >> inStr)
+            if (inStr.size() == 1 && std::string("IXYZixyz").find(inStr[0]) != std::string::npos)
+                pauli = toupper(inStr[0]);
+
+        if (term[qubit] == 'I')
+            term[qubit] = pauli;
+        else if (term[qubit] == pauli)
+            term[qubit] = 'I'; // P P = I
+        else if (pauli != 'I')
+        {
+            std::cerr << "[error]Pauli string with both " << term[qubit] << " and " << pauli << " on qubit " << qubit << " is not Hermitian" << std::endl;
+            std::exit(1);
+        }
+        getline(inStr_ss, prefix, '[');
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [simulate the circuit described by a qasm file]
+
+  Description [qasm holds the size bytes of the file; it is compiled once
+               and not referenced afterwards. With a circuit cache the
+               compiled circuit is read from the cache directory when
+               the same text was compiled before, and written there
+               otherwise.]
+
+  SideEffects []
+
   SeeAlso     []
 
 ***********************************************************************/
-void Simulator::sim_qasm_file(std::string qasm)
+void Simulator::sim_qasm(const char *qasm, size_t size)
 {
-    std::string inStr;
-    std::stringstream inFile_ss(qasm);
-    while (getline(inFile_ss, inStr))
+    std::string cache_path;
+    unsigned long long hash = 0;
+    if (!circuit_cache.empty())
     {
-        inStr = inStr.substr(0, inStr.find("//"));
-        if (inStr.find_first_not_of("\t\n ") != std::string::npos)
-        {
-            std::stringstream inStr_ss(inStr);
-            getline(inStr_ss, inStr, ' ');
-            if (inStr == "qreg")
-            {
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                init_simulator(stoi(inStr));
-            }
-            else if (inStr == "creg")
-            {
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                nClbits = stoi(inStr);
-            }
-            else if (inStr == "OPENQASM"){;}
-            else if (inStr == "include"){;}
-            else if (inStr == "measure")
-            {
-                isMeasure = 1;
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                int qIndex = stoi(inStr);
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                int cIndex = stoi(inStr);
-                measure(qIndex, cIndex);
-            }
-            else if (inStr == "initial_state") // Add initial state
-            {
-                // Construct the initial state matrix
-                const int INITIAL_STATE_PRECISION = 20;
-                int state_k = INITIAL_STATE_PRECISION*2;
-                std::vector<std::vector<int>> state_matrix(w, std::vector<int>(pow(2,n),0));
-                for (int i = 0 ; i < pow(2,n) ; i++)
-                {
-                    // Read the coefficient of the i-th basis state
-                    getline(inFile_ss, inStr);
+        char name[32];
+        hash = qasm_hash(qasm, qasm + size, res);
+        snprintf(name, sizeof(name), "/%016llx.sqc", hash);
+        cache_path = circuit_cache + name;
+    }
+    if (cache_path.empty() || !load_circuit(cache_path, hash, size))
+    {
+        compile_qasm(qasm, qasm + size, Circuit, true);
+        n = Circuit.nQubits; // length of the Pauli strings
+        nClbits = Circuit.nClbits;
+        parse_expvals(Circuit.expvals);
+        if (!cache_path.empty() && !Circuit.isExternal)
+            save_circuit(cache_path, hash, size);
+    }
+    lightcone(); // drop what exp_val cannot see
+    sim_circuit(0); // simulate
+    sim_results();
+}
 
-                    // Get the real and imaginary part
-                    std::string doubleStr;
-                    std::stringstream inDouble_ss(inStr);
-                    double real_part, imag_part;
-                    bool use_minus_delimiter = false;
-                    bool neg_real = false, neg_imag = false;
+/**Function*************************************************************
 
-                    // Determine whether the real or imaginary part is negative
-                    if (inStr[0] == '-')
-                    {
-                        neg_real = true;
-                        inDouble_ss.str(inStr.substr(1));
-                    }
-                    else if (inStr[0] == '+')
-                    {
-                        inDouble_ss.str(inStr.substr(1));
-                    }
-                    if (inDouble_ss.str().find_first_of('-') != std::string::npos)
-                    {
-                        use_minus_delimiter = true;
-                        neg_imag = true;
-                    }
+  Synopsis    [Pieces of compiled circuit on their way from the parser
+               thread to the simulator]
 
-                    // Split the string to obtain the real and imaginary part
-                    if (use_minus_delimiter)
-                        getline(inDouble_ss, doubleStr, '-');
-                    else
-                        getline(inDouble_ss, doubleStr, '+');
-                    real_part = (neg_real)? -stod(doubleStr) : stod(doubleStr);
-                    getline(inDouble_ss, doubleStr, 'i');
-                    imag_part = (neg_imag)? -stod(doubleStr) : stod(doubleStr);
-
-                    // Add the read coefficient to the initial state matrix
-                    // real part to d, imaginary part to b
-                    state_matrix[3][i] = int(std::round(real_part*pow(2,INITIAL_STATE_PRECISION)));
-                    state_matrix[1][i] = int(std::round(imag_part*pow(2,INITIAL_STATE_PRECISION)));
-                }
+  Description [At most capacity pieces wait; push blocks while the queue
+               is full and pop while it is empty. pop returns false once
+               the queue is closed and drained.]
 
-                // Add initial state
-                init_state_by_matrix(state_k,state_matrix);
+  SideEffects []
 
-                // Delete the initial state matrix
-                state_matrix.clear();
-            }
-            else if (inStr == "exp_val") // Calculate expectation value
-            {
-                getline(inStr_ss, inStr, '[');
-                while(getline(inStr_ss, inStr, ']'))
-                {
-                    expval_qubits.push_back(stoi(inStr));
-                    getline(inStr_ss, inStr, '[');
-                }
-            }
-            else if (inStr == "rus"){
-                std::vector<int> buffer;
-                getline(inStr_ss, inStr, '[');
-                while(getline(inStr_ss, inStr, ']'))
-                {
-                    // std::cout<<inStr<<std::endl;
-                    buffer.push_back(stoi(inStr));
-                    getline(inStr_ss, inStr, '[');
-                }
-                assert(buffer.size() % 2 == 0);
-                std::vector<int> mqubits(buffer.begin(), buffer.begin() + buffer.size() / 2);
-                std::vector<int> cond(buffer.begin() + buffer.size() / 2, buffer.end());
-                assert(mqubits.size() == cond.size());
-                RUS(mqubits, cond);
-            }
-            else
+  SeeAlso     [sim_qasm_stream]
+
+***********************************************************************/
+class CircuitQueue
+{
+public:
+    CircuitQueue(int capacity) : capacity(capacity), isClosed(false) {}
+    void push(CircuitCode &code)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return (int) pieces.size() < capacity; });
+        pieces.push_back(std::move(code));
+        notEmpty.notify_one();
+    }
+    bool pop(CircuitCode &code)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !pieces.empty() || isClosed; });
+        if (pieces.empty())
+            return false;
+        code = std::move(pieces.front());
+        pieces.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isClosed = true;
+        notEmpty.notify_one();
+    }
+
+private:
+    int capacity;
+    bool isClosed;
+    std::deque<CircuitCode> pieces;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+};
+
+/**Function*************************************************************
+
+  Synopsis    [Parser thread of sim_qasm_stream]
+
+  Description [Reads the stream in blocks, compiles the complete lines of
+               each block and queues the result. The register sizes carry
+               over from one piece to the next; the last piece is always
+               queued, so the final sizes reach the simulator. An
+               initial_state left incomplete is compiled again from its
+               first line, so the next read is at least as long as the
+               text held: the reads double and the amplitudes are parsed
+               a constant number of times on average.]
+
+  SideEffects []
+
+  SeeAlso     [sim_qasm_stream compile_qasm]
+
+***********************************************************************/
+static void parse_stream(Simulator *simulator, std::istream *in, CircuitQueue *queue)
+{
+    const size_t BLOCK_SIZE = 1 << 18;
+    std::string text; // unparsed text, a partial line or an initial_state at most
+    CircuitCode code;
+    bool isLast = false;
+    while (!isLast)
+    {
+        size_t size = text.size(), length = std::max(BLOCK_SIZE, size);
+        text.resize(size + length);
+        in->read(&text[size], length);
+        text.resize(size + in->gcount());
+        isLast = !*in;
+
+        size_t cut = isLast ? text.size() : text.rfind('\n') + 1; // 0 if no line is complete
+        const char *stop = simulator->compile_qasm(text.data(), text.data() + cut, code, isLast);
+        text.erase(0, stop - text.data());
+        if (code.ops.empty() && code.expvals.empty() && !isLast)
+            continue;
+
+        CircuitCode next;
+        next.nQubits = code.nQubits;
+        next.nClbits = code.nClbits;
+        queue->push(code);
+        code = next;
+    }
+    queue->close();
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Simulate a qasm file while it is being read from in]
+
+  Description [A parser thread compiles the text into pieces and a bounded
+               queue hands them to the simulator, so parsing overlaps the
+               BDD operations and only a few pieces of the circuit are held
+               at a time. After a mid-circuit measurement that branches,
+               the rest of the circuit is kept, since every branch runs it.
+               The lightcone and the circuit cache need the whole text and
+               are not used here.]
+
+  SideEffects []
+
+  SeeAlso     [sim_qasm parse_stream]
+
+***********************************************************************/
+void Simulator::sim_qasm_stream(std::istream &in)
+{
+    CircuitQueue queue(8);
+    std::thread parser(parse_stream, this, &in, &queue);
+
+    std::vector<std::pair<std::string, std::string>> expvals;
+    std::vector<int> qubits;
+    CircuitCode code;
+    int pc = 0;
+    bool isBranch = false;
+    while (queue.pop(code))
+    {
+        nClbits = code.nClbits;
+        expvals.insert(expvals.end(), code.expvals.begin(), code.expvals.end());
+        if (isBranch)
+        {
+            // shift the operands and initial states of the piece behind those kept
+            for (int i = 0; i < code.ops.size(); i++)
             {
-                if (inStr == "x")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    PauliX(stoi(inStr));
-                }
-                else if (inStr == "y")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    PauliY(stoi(inStr));
-                }
-                else if (inStr == "z")
-                {
-                    std::vector<int> iqubit(1);
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    iqubit[0] = stoi(inStr);
-                    PauliZ(iqubit);
-                    iqubit.clear();
-                }
-                else if (inStr == "h")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    Hadamard(stoi(inStr));
-                }
-                else if (inStr == "s")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift(2, iqubit);
-                }
-                else if (inStr == "sdg")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift_dagger(-2, iqubit);
-                }
-                else if (inStr == "t")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift(4, iqubit);
-                }
-                else if (inStr == "tdg")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift_dagger(-4, iqubit);
-                }
-                else if (inStr == "rx(pi/2)")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    rx_pi_2(stoi(inStr));
-                }
-                else if (inStr == "ry(pi/2)")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    ry_pi_2(stoi(inStr));
-                }
-                else if (inStr == "cx")
-                {
-                    std::vector<int> cont(1);
-                    std::vector<int> ncont(0);
-                    int targ;
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    cont[0] = stoi(inStr);
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    targ = stoi(inStr);
-                    Toffoli(targ, cont, ncont);
-                    cont.clear();
-                    ncont.clear();
-                }
-                else if (inStr == "cz")
-                {
-                    std::vector<int> iqubit(2);
-                    for (int i = 0; i < 2; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        iqubit[i] = stoi(inStr);
-                    }
-                    PauliZ(iqubit);
-                    iqubit.clear();
-                }
-                else if (inStr == "swap")
-                {
-                    int swapA, swapB;
-                    std::vector<int> cont(0);
-                    for (int i = 0; i < 2; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        if (i == 0)
-                            swapA = stoi(inStr);
-                        else
-                            swapB = stoi(inStr);
-                    }
-                    Fredkin(swapA, swapB, cont);
-                    cont.clear();
-                }
-                else if (inStr == "cswap")
-                {
-                    int swapA, swapB;
-                    std::vector<int> cont(1);
-                    for (int i = 0; i < 3; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        if (i == 0)
-                            cont[i] = stoi(inStr);
-                        else if (i == 1)
-                            swapA = stoi(inStr);
-                        else
-                            swapB = stoi(inStr);
-                    }
-                    Fredkin(swapA, swapB, cont);
-                    cont.clear();
-                }
-                else if (inStr == "ccx" || inStr == "mcx")
-                {
-                    std::vector<int> cont(0);
-                    std::vector<int> ncont(0);
-                    int targ;
-                    getline(inStr_ss, inStr, '[');
-                    while(getline(inStr_ss, inStr, ']'))
-                    {
-                        cont.push_back(stoi(inStr));
-                        getline(inStr_ss, inStr, '[');
-                    }
-                    targ = cont.back();
-                    cont.pop_back();
-                    Toffoli(targ, cont, ncont);
-                    cont.clear();
-                    ncont.clear();
-                }
-                else
-                {
-                    std::cerr << std::endl
-                            // << "[warning]: Gate \'" << inStr << "\' is not supported in this simulator. The gate is ignored ..." << std::endl;
-                            << "[warning]: Syntax \'" << inStr << "\' is not supported in this simulator. The line is ignored ..." << std::endl;
-                }
+                code.ops[i].start += Circuit.operands.size();
+                if (code.ops[i].code == OP_INITIAL_STATE)
+                    code.ops[i].m += Circuit.states.size();
             }
+            Circuit.ops.insert(Circuit.ops.end(), code.ops.begin(), code.ops.end());
+            Circuit.operands.insert(Circuit.operands.end(), code.operands.begin(), code.operands.end());
+            for (int i = 0; i < code.states.size(); i++)
+                Circuit.states.push_back(std::move(code.states[i]));
+            continue;
         }
+        Circuit = std::move(code);
+        pc = run_circuit(0, qubits);
+        isBranch = (pc < Circuit.ops.size());
     }
-    if (isReorder) Cudd_AutodynDisable(manager);
+    parser.join();
+
+    parse_expvals(expvals);
+    sim_circuit(pc); // branches from pc, if any
+    sim_results();
 }
 
 /**Function*************************************************************
 
-  Synopsis    [simulate the circuit described by a qasm file]
+  Synopsis    [Parse the exp_val and exp_term lines kept by compile_qasm]
 
-  Description []
+  Description [Each entry is the keyword and the rest of its line.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [parse_expval]
 
 ***********************************************************************/
-void Simulator::sim_qasm(std::string qasm)
+void Simulator::parse_expvals(std::vector<std::pair<std::string, std::string>> &expvals)
 {
-    if (!usingVQE)
-        sim_qasm_file(qasm); // simulate
-    else
-        sim_qasm_file_VQE(qasm); // using VQE
+    for (int i = 0; i < expvals.size(); i++)
+    {
+        std::stringstream inStr_ss(expvals[i].second);
+        parse_expval(expvals[i].first, inStr_ss);
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Check the options against the simulated circuit and
+               produce the requested outputs]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [sim_qasm sim_qasm_stream]
 
-    if (sim_type == 0 && isMeasure == 0 && expval_qubits.empty())
+***********************************************************************/
+void Simulator::sim_results()
+{
+    if (sim_type == 0 && isMeasure == 0 && expval_terms.empty() && query_states.empty())
     {
         std::cout << "Error: no measurement detected. Cannot do sampling.\n" << std::flush;
-        assert(sim_type != 0 || isMeasure != 0 || !expval_qubits.empty());
+        assert(sim_type != 0 || isMeasure != 0 || !expval_terms.empty() || !query_states.empty());
+    }
+    if (sim_type == 2)
+    {
+        if (isMeasure == 0 && expval_terms.empty() && query_states.empty())
+        {
+            std::cout << "Error: no measurement detected. Cannot compute the distribution.\n" << std::flush;
+            assert(isMeasure != 0 || !expval_terms.empty() || !query_states.empty());
+        }
+        if (nClbits > 30)
+        {
+            std::cerr << "[error]The distribution over " << nClbits << " clbits is too large to be listed" << std::endl;
+            std::exit(1);
+        }
+        if (shots != 1)
+        {
+            std::cout << "Warning: the --shots argument is ignored in probability mode.\n" << std::flush;
+        }
+    }
+    if (sim_type == 0 && top_k > 0 && shots != 1)
+    {
+        std::cout << "Warning: the --shots argument is ignored with --top_k.\n" << std::flush;
+    }
+    if (sim_type != 0 && top_k > 0)
+    {
+        std::cout << "Warning: the --top_k argument is only used in sampling mode.\n" << std::flush;
+    }
+    if (sim_type != 1 && !statevector_file.empty())
+    {
+        std::cout << "Warning: the --statevector_file argument is only used in all_amplitude mode.\n" << std::flush;
     }
-    if (sim_type == 1)
+    if (sim_type == 1 || sim_type == 3)
     {
         if (isMeasure == 1)
         {
@@ -347,7 +1318,7 @@ void Simulator::sim_qasm(std::string qasm)
             if (shots != 1)
             {
                 shots = 1;
-                std::cout << "Warning: shot number is limited to 1 in all_amplitude mode.\n" << std::flush;
+                std::cout << "Warning: shot number is limited to 1 in " << (sim_type == 1 ? "all_amplitude" : "sparse_amplitude") << " mode.\n" << std::flush;
             }
         }
         else
@@ -359,24 +1330,59 @@ void Simulator::sim_qasm(std::string qasm)
         }
     }
 
-    // measure based on simulator type
-    if (sim_type == 0) // sampling mode
+    if (!query_states.empty())
     {
-        measurement();
+        getQueries();
     }
-    else if (sim_type == 1) // all_amplitude mode
+
+    // each branch of a mid-circuit measurement adds its outcomes, weighted by its probability
+    double expval_sum = 0, prob_sum = 0;
+    for (int b = 0; b < std::max((int) branches.size(), 1); b++)
     {
-        if (isMeasure == 1)
+        if (!branches.empty())
+            load_branch(branches[b]);
+
+        // measure based on simulator type
+        if (sim_type == 0) // sampling mode
+        {
+            measurement();
+        }
+        else if (sim_type == 1) // all_amplitude mode
+        {
+            if (isMeasure == 1)
+            {
+                measurement();
+            }
+            getStatevector();
+        }
+        else if (sim_type == 3) // sparse_amplitude mode
+        {
+            if (isMeasure == 1)
+            {
+                measurement();
+            }
+            getSparseStatevector();
+        }
+        else if (sim_type == 2 && isMeasure == 1) // probability mode
         {
             measurement();
         }
-        getStatevector();
-    }
 
-    if (!expval_qubits.empty())
-    {
-        getExpectVal();
+        if (!expval_terms.empty())
+        {
+            getExpectVal();
+            double prob = clbit_records.empty() ? 1 : 0;
+            std::map<std::string, std::pair<int, double>>::iterator it;
+            for (it = clbit_records.begin(); it != clbit_records.end(); it++)
+                prob += it->second.second;
+            expval_sum += prob * expval;
+            prob_sum += prob;
+        }
+        if (b + 1 < branches.size())
+            free_bdd(All_Bdd, r);
     }
+    if (!expval_terms.empty())
+        expval = expval_sum / prob_sum;
     print_results();
 }
 
@@ -398,286 +1404,50 @@ void Simulator::print_results()
     // write output string based on state_count and statevector
     std::unordered_map<std::string, int>::iterator it;
 
-    run_output = "{";
+    std::vector<std::string> fields;
     if (state_count.begin() != state_count.end())
     {
-        run_output += "\"counts\": { ";
+        std::string counts = "\"counts\": { ";
         for (it = state_count.begin(); it != state_count.end(); it++)
         {
-            if (std::next(it) == state_count.end())
-                run_output = run_output + "\"" + it->first + "\": " + std::to_string(it->second);
-            else
-                run_output = run_output + "\"" + it->first + "\": " + std::to_string(it->second) + ", ";
+            counts += (it == state_count.begin()) ? "\"" : ", \"";
+            counts += it->first + "\": " + std::to_string(it->second);
         }
-        run_output += " }";
-        run_output += (statevector != "null") ? ", " : "";
+        fields.push_back(counts + " }");
+    }
+    if (!marginal_prob.empty())
+    {
+        std::ostringstream prob_ss;
+        prob_ss.precision(17);
+        prob_ss << "\"probabilities\": [";
+        for (size_t i = 0; i < marginal_prob.size(); i++)
+            prob_ss << (i ? ", " : "") << marginal_prob[i];
+        prob_ss << "]";
+        fields.push_back(prob_ss.str());
+    }
+    if (!top_result.empty())
+    {
+        std::ostringstream top_ss;
+        top_ss.precision(17);
+        top_ss << "\"top_k\": [";
+        for (int i = 0; i < top_result.size(); i++)
+            top_ss << (i ? ", [\"" : "[\"") << top_result[i].first << "\", " << top_result[i].second << "]";
+        top_ss << "]";
+        fields.push_back(top_ss.str());
     }
+    if (!query_result.empty())
+        fields.push_back("\"queries\": " + query_result);
+    if (statevector != "null")
+        fields.push_back((sim_type == 3 ? "\"amplitudes\": " : statevector_file.empty() ? "\"statevector\": " : "\"statevector_file\": ") + statevector);
 
-    run_output += (statevector != "null") ? "\"statevector\": " + statevector + " }" : " }";
+    run_output = "{";
+    for (int i = 0; i < fields.size(); i++)
+        run_output += (i ? ", " : "") + fields[i];
+    run_output += " }";
     std::cout << run_output << std::endl;
 
-    if (!expval_qubits.empty())
+    if (!expval_terms.empty())
     {
         std::cout << "The expectation value is " << expval << std::endl;
     }
 }
-
-// Using VQE
-void Simulator::sim_qasm_file_VQE(std::string qasm)
-{
-    std::string inStr;
-    std::stringstream inFile_ss(qasm);
-    while (getline(inFile_ss, inStr))
-    {
-        inStr = inStr.substr(0, inStr.find("//"));
-        if (inStr.find_first_not_of("\t\n ") != std::string::npos)
-        {
-            std::stringstream inStr_ss(inStr);
-            getline(inStr_ss, inStr, ' ');
-            if (inStr == "qreg")
-            {
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                init_simulator(stoi(inStr));
-            }
-            else if (inStr == "creg")
-            {
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                nClbits = stoi(inStr);
-            }
-            else if (inStr == "OPENQASM"){;}
-            else if (inStr == "include"){;}
-            else if (inStr == "measure")
-            {
-                isMeasure = 1;
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                int qIndex = stoi(inStr);
-                getline(inStr_ss, inStr, '[');
-                getline(inStr_ss, inStr, ']');
-                int cIndex = stoi(inStr);
-                measure(qIndex, cIndex);
-            }
-            else if (inStr == "initial_state") // Add initial state
-            {
-                // Construct the initial state matrix
-                const int INITIAL_STATE_PRECISION = 20;
-                int state_k = INITIAL_STATE_PRECISION*2;
-                std::vector<std::vector<int>> state_matrix(w, std::vector<int>(pow(2,n),0));
-                for (int i = 0 ; i < pow(2,n) ; i++)
-                {
-                    // Read the coefficient of the i-th basis state
-                    getline(inFile_ss, inStr);
-
-                    // Get the real and imaginary part
-                    std::string doubleStr;
-                    std::stringstream inDouble_ss(inStr);
-                    double real_part, imag_part;
-                    bool use_minus_delimiter = false;
-                    bool neg_real = false, neg_imag = false;
-
-                    // Determine whether the real or imaginary part is negative
-                    if (inStr[0] == '-')
-                    {
-                        neg_real = true;
-                        inDouble_ss.str(inStr.substr(1));
-                    }
-                    else if (inStr[0] == '+')
-                    {
-                        inDouble_ss.str(inStr.substr(1));
-                    }
-                    if (inDouble_ss.str().find_first_of('-') != std::string::npos)
-                    {
-                        use_minus_delimiter = true;
-                        neg_imag = true;
-                    }
-
-                    // Split the string to obtain the real and imaginary part
-                    if (use_minus_delimiter)
-                        getline(inDouble_ss, doubleStr, '-');
-                    else
-                        getline(inDouble_ss, doubleStr, '+');
-                    real_part = (neg_real)? -stod(doubleStr) : stod(doubleStr);
-                    getline(inDouble_ss, doubleStr, 'i');
-                    imag_part = (neg_imag)? -stod(doubleStr) : stod(doubleStr);
-
-                    // Add the read coefficient to the initial state matrix
-                    // real part to d, imaginary part to b
-                    state_matrix[3][i] = int(std::round(real_part*pow(2,INITIAL_STATE_PRECISION)));
-                    state_matrix[1][i] = int(std::round(imag_part*pow(2,INITIAL_STATE_PRECISION)));
-                }
-
-                // Add initial state
-                init_state_by_matrix(state_k,state_matrix);
-
-                // Delete the initial state matrix
-                state_matrix.clear();
-            }
-            else if (inStr == "exp_val") // Calculate expectation value
-            {
-                getline(inStr_ss, inStr, '[');
-                while(getline(inStr_ss, inStr, ']'))
-                {
-                    expval_qubits.push_back(stoi(inStr));
-                    getline(inStr_ss, inStr, '[');
-                }
-            }
-            else
-            {
-                /*if (inStr == "x")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    PauliX(stoi(inStr));
-                }*/
-                /*else if (inStr == "y")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    PauliY(stoi(inStr));
-                }*/
-                if (inStr == "z")
-                {
-                    std::vector<int> iqubit(1);
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    iqubit[0] = stoi(inStr);
-                    PauliZ(iqubit);
-                    iqubit.clear();
-                }
-                else if (inStr == "h")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    Hadamard(stoi(inStr));
-                }
-                else if (inStr == "s")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift(2, iqubit);
-                }
-                else if (inStr == "sdg")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift_dagger(-2, iqubit);
-                }
-                else if (inStr == "t")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift(4, iqubit);
-                }
-                else if (inStr == "tdg")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    int iqubit = stoi(inStr);
-                    Phase_shift_dagger(-4, iqubit);
-                }
-                /*else if (inStr == "rx(pi/2)")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    rx_pi_2(stoi(inStr));
-                }*/
-                /*else if (inStr == "ry(pi/2)")
-                {
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    ry_pi_2(stoi(inStr));
-                }*/
-                else if (inStr == "cx")
-                {
-                    std::vector<int> cont(1);
-                    std::vector<int> ncont(0);
-                    int targ;
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    cont[0] = stoi(inStr);
-                    getline(inStr_ss, inStr, '[');
-                    getline(inStr_ss, inStr, ']');
-                    targ = stoi(inStr);
-                    Toffoli(targ, cont, ncont);
-                    cont.clear();
-                    ncont.clear();
-                }
-                /*else if (inStr == "cz")
-                {
-                    std::vector<int> iqubit(2);
-                    for (int i = 0; i < 2; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        iqubit[i] = stoi(inStr);
-                    }
-                    PauliZ(iqubit);
-                    iqubit.clear();
-                }*/
-                /*else if (inStr == "swap")
-                {
-                    int swapA, swapB;
-                    std::vector<int> cont(0);
-                    for (int i = 0; i < 2; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        if (i == 0)
-                            swapA = stoi(inStr);
-                        else
-                            swapB = stoi(inStr);
-                    }
-                    Fredkin(swapA, swapB, cont);
-                    cont.clear();
-                }*/
-                /*else if (inStr == "cswap")
-                {
-                    int swapA, swapB;
-                    std::vector<int> cont(1);
-                    for (int i = 0; i < 3; i++)
-                    {
-                        getline(inStr_ss, inStr, '[');
-                        getline(inStr_ss, inStr, ']');
-                        if (i == 0)
-                            cont[i] = stoi(inStr);
-                        else if (i == 1)
-                            swapA = stoi(inStr);
-                        else
-                            swapB = stoi(inStr);
-                    }
-                    Fredkin(swapA, swapB, cont);
-                    cont.clear();
-                }*/
-                /*else if (inStr == "ccx" || inStr == "mcx")
-                {
-                    std::vector<int> cont(0);
-                    std::vector<int> ncont(0);
-                    int targ;
-                    getline(inStr_ss, inStr, '[');
-                    while(getline(inStr_ss, inStr, ']'))
-                    {
-                        cont.push_back(stoi(inStr));
-                        getline(inStr_ss, inStr, '[');
-                    }
-                    targ = cont.back();
-                    cont.pop_back();
-                    Toffoli(targ, cont, ncont);
-                    cont.clear();
-                    ncont.clear();
-                }*/
-                else
-                {
-                    std::cerr << std::endl
-                            // << "[warning]: Gate \'" << inStr << "\' is not supported in this simulator. The gate is ignored ..." << std::endl;
-                            << "[warning]: Syntax \'" << inStr << "\' is not supported in this simulator. The line is ignored ..." << std::endl;
-                }
-            }
-        }
-    }
-    if (isReorder) Cudd_AutodynDisable(manager);
-}
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <stdio.h> // FILE
 #include <unordered_map>
+#include <map>
 #include <sys/time.h> //estimate time
 #include <fstream> //fstream
 #include <sstream> // int to string
@@ -13,6 +14,9 @@
 #include <random>
 #include <cmath>
 #include <vector>
+#include <complex>
+#include <atomic>
+#include <gmpxx.h>
 #include "../cudd/cudd/cudd.h"
 #include "../cudd/cudd/cuddInt.h"
 #include "../cudd/util/util.h"
@@ -20,19 +24,84 @@
 
 #define PI 3.14159265358979323846264338327950288419716939937510582097494459230781640628620899
 
+// the cofactors of all w * r slices, as runs of equal nodes: (node, length)
+typedef std::pair<DdNode *, int> SliceRun;
+typedef std::vector<SliceRun> SliceTuple;
+
+// tuple nodes of a partial outcome, summed over the unmeasured levels above: (id, weight)
+typedef std::vector<std::pair<int, double>> Frontier;
+
+// a distinct tuple met while computing probabilities
+struct TupleNode
+{
+    int start, length; // runs in Tuple_Run
+    int position; // top level of the slices, n if all are constants
+    int child[2]; // cofactors at position, -1 until needed
+    double prob; // summed prob from position down, -1 until needed
+    double best; // prob of the best outcome below, used in top_outcomes, -1 until needed
+};
+
+// opcodes of CircuitOp; those before OP_X flush the pending gates, see is_buffered_op
+enum
+{
+    OP_QREG, OP_MEASURE, OP_INITIAL_STATE, OP_INIT_PLUS, OP_INIT_BASIS, OP_INIT_GHZ, OP_INIT_DICKE, OP_RUS,
+    OP_X, OP_Y, OP_Z, OP_H, OP_S, OP_SDG, OP_T, OP_TDG, OP_RX, OP_RY, OP_RZ, OP_U1,
+    OP_CX, OP_CZ, OP_SWAP, OP_CSWAP, OP_MCX
+};
+
+// an instruction of the compiled circuit
+struct CircuitOp
+{
+    int code; // OP_*
+    int m; // angle multiple of rz (pi/res) and u1 (pi/w), index in CircuitCode::states of initial_state, weight of init dicke,
+           // 1 for an init plus compiled from h gates
+    int start, count; // operands in CircuitCode::operands: qubits, then clbits of measure or conditions of rus
+};
+
+static const int INITIAL_STATE_PRECISION = 20; // amplitudes of initial_state are rounded to multiples of 2^-20
+
+// nonzero amplitudes of an initial_state, as multiples of 2^-INITIAL_STATE_PRECISION
+struct InitialState
+{
+    std::vector<unsigned long long> index; // basis state, qubit q is bit q
+    std::vector<int> value; // real and imaginary part of each amplitude
+};
+
+// a circuit, or a piece of it, compiled by compile_qasm
+struct CircuitCode
+{
+    CircuitCode() : nQubits(0), nClbits(0), isExternal(false) {}
+    std::vector<CircuitOp> ops;
+    std::vector<int> operands;
+    std::vector<InitialState> states; // amplitudes of each initial_state
+    std::vector<std::pair<std::string, std::string>> expvals; // keyword and rest of each exp_val and exp_term line
+    int nQubits, nClbits; // sizes of the last qreg and creg
+    bool isExternal; // an initial_state was read from a file, so the text alone does not determine the circuit
+};
+
+// a state of the run after mid-circuit measurements, see split_branches
+struct Branch
+{
+    DdNode ***Bdd;
+    int r, k, shift;
+    double rus_normalize_factor;
+    std::vector<std::vector<int>> measured_qubits_to_clbits;
+    std::map<std::string, std::pair<int, double>> records; // clbits measured so far -> (shots, probability)
+};
+
 class Simulator
 {
 public:
     // constructor and destructor
     Simulator(int type, int nshots, int seed, int bitSize, bool reorder, bool alloc) :
-    n(0), r(bitSize), w(4), k(0), inc(3), shift(0), error(0),
-    normalize_factor(1),rus_normalize_factor(1), gatecount(0), NodeCount(0), isMeasure(0), shots(nshots), isReorder(reorder), isAlloc(alloc)
-    , sim_type(type), statevector("null"), gen(std::default_random_engine(seed)){
+    n(0), r(bitSize), w(4), k(0), inc(3), shift(0), shots(nshots), top_k(0), sim_type(type), isMeasure(0), isReorder(reorder), isAlloc(alloc),
+    expval_index(-1), normalize_factor(1), rus_normalize_factor(1), gen(std::default_random_engine(seed)), tuple_epoch(1), sum_epoch(1)
+    , statevector("null"), gatecount(0), NodeCount(0), error(0), res(2){
     }
     Simulator(int nshots, int seed, int bitSize, bool reorder, bool alloc) :
-    n(0), r(bitSize), w(4), k(0), inc(3), shift(0), error(0),
-    normalize_factor(1),rus_normalize_factor(1), gatecount(0), NodeCount(0), isMeasure(0), shots(nshots), isReorder(reorder), isAlloc(alloc)
-    , sim_type(0), statevector("null"), gen(std::default_random_engine(seed)){
+    n(0), r(bitSize), w(4), k(0), inc(3), shift(0), shots(nshots), top_k(0), sim_type(0), isMeasure(0), isReorder(reorder), isAlloc(alloc),
+    expval_index(-1), normalize_factor(1), rus_normalize_factor(1), gen(std::default_random_engine(seed)), tuple_epoch(1), sum_epoch(1)
+    , statevector("null"), gatecount(0), NodeCount(0), error(0), res(2){
     }
     ~Simulator()  {
         clear();
@@ -40,17 +109,17 @@ public:
 
     /* gates */
     void Toffoli(int targ, std::vector<int> cont, std::vector<int> ncont);
-    void Fredkin(int swapA , int swapB, std::vector<int> cont);
     void Peres(int a, int b, int c);
     void Peres_i(int a, int b, int c);
     void Hadamard(int iqubit);
     void rx_pi_2(int iqubit);
     void ry_pi_2(int iqubit);
-    void Phase_shift(int phase, int iqubit); // phase can only be 2 to the power of an integer
-    void Phase_shift_dagger(int phase, int iqubit);
+    void Phase_rotate(int m0, int m1, int iqubit); // multiply by omega^m0 if iqubit is 0, omega^m1 if 1
+    void rz(int m, int iqubit); // rz(m*pi/res)
+    void u1(int m, int iqubit); // u1(m*pi/w), also p
+    void Unitary(int iqubit, std::vector<std::vector<long long>> M, int mk); // exact M / sqrt(2)^mk, entries 00, 01, 10, 11 in Z[omega]
     void PauliX(int iqubit);
     void PauliY(int iqubit);
-    void PauliZ(std::vector<int> iqubit); // Z or CZ
     void measure(int qreg, int creg);
     void RUS(std::vector<int> mqubits, std::vector<int> cond);
 
@@ -58,46 +127,75 @@ public:
     void getExpectVal();
     void measurement();
     void getStatevector();
+    void getSparseStatevector();
+    void getQueries();
 
     /* simulation */
     void init_simulator(int n);
-    void sim_qasm_file(std::string qasm);
-    void sim_qasm_file_VQE(std::string qasm);
-    void sim_qasm(std::string qasm);
+    const char *compile_qasm(const char *begin, const char *end, CircuitCode &code, bool isLast);
+    void sim_circuit(int pc);
+    void sim_qasm(const char *qasm, size_t size);
+    void sim_qasm_stream(std::istream &in); // parse in a thread while simulating
+    void sim_results();
+    void lightcone(); // keep only what exp_val depends on
     void print_results();
 
     /* misc */
     void reorder();
     void decode_entries();
     void print_info(double runtime, size_t memPeak);
-    void setVQEParam(int _res, bool _usingVQE); // using VQE
+    void setVQEParam(int _res); // resolution of rz angles (--rz_res), w = 2 * res (--res)
+    void setStatevectorFile(std::string path); // write the statevector to a .npy file
+    void setQuery(std::string states); // comma-separated basis states for getQueries
+    void setTopK(int k); // show the k most probable outcomes instead of sampling
+    void setCircuitCache(std::string dir); // keep compiled circuits in dir
 
 private:
     DdManager *manager;
     DdNode ***All_Bdd;
     int n; // # of qubits
     int r; // resolution of integers
-    int w; // # of integers
+    int w; // # of integers, omega = e^(i*pi/w)
     int k; // k in algebraic representation
     int inc; // add inc BDDs when overflow occurs, used in alloc_BDD
     int shift; // # of right shifts
     int shots;
-    int sim_type; // 0: statevector, 1: measure
+    int top_k; // # of most probable outcomes shown in sampling mode, 0 to sample
+    int sim_type; // 0: sampling, 1: all_amplitude, 2: probability, 3: sparse_amplitude
     bool isMeasure;
     bool isReorder;
     bool isAlloc;
     int nClbits;
-    std::vector<int> expval_qubits;
+    std::vector<std::pair<double, std::string>> expval_terms; // weight and Pauli string (one letter per qubit) of each term
+    int expval_index; // term of the exp_val lines, -1 if none
     double expval;
     std::vector<std::vector<int>> measured_qubits_to_clbits; // empty if not measured
+    std::vector<int> clbit_writer; // qubit of the last measure of each clbit in program order, -1 if none; only its value is kept
+    std::map<std::string, std::pair<int, double>> clbit_records; // clbits measured mid-circuit -> (shots, probability), empty if none
+    std::string clbit_record; // record of the outcomes being counted, used in outcome_clbits
+    std::vector<Branch> branches; // states of the run after mid-circuit measurements, empty if none
     std::string measure_outcome;
     double normalize_factor; // normalization factor used in measurement
     double rus_normalize_factor; // normalization factor used in RUS
-    DdNode *bigBDD; // big BDD used if measurement
     std::default_random_engine gen; // random generator
-    std::unordered_map<DdNode *, double> Node_Table; // key: node, value: summed prob
+    std::vector<TupleNode> Tuple_Node;
+    std::vector<SliceRun> Tuple_Run; // runs of all tuple nodes
+    std::vector<std::pair<unsigned, int>> Tuple_Slot; // open addressing table of Tuple_Node: (epoch, id)
+    unsigned tuple_epoch;
+    SliceTuple tuple_scratch; // tuple being looked up by tuple_id
+    std::vector<std::pair<unsigned, double>> Sum_Memo; // sums of tuple_sum by node id: (epoch, sum)
+    std::vector<int> measured_above; // # of measured levels above each level, n + 1 entries, set by measurement
+    unsigned sum_epoch;
+    std::vector<double> leaf_pow2, leaf_re, leaf_im; // 2^(j + shift - k/2) and omega^(w-1-i), used in tuple_entry
+    std::vector<mpf_class> leaf_re_gmp, leaf_im_gmp; // omega^(w-1-i), used in tuple_amplitude_gmp
+    std::complex<double> amp_factor; // 1/sqrt(2)^(k%2) and the normalization factors, used in amplitude_fill
     std::unordered_map<std::string, int> state_count;
+    std::vector<double> marginal_prob; // exact distribution of the clbits, used in probability mode
+    std::vector<std::pair<std::string, double>> top_result; // outcomes of top_outcomes, most probable first
     std::string statevector;
+    std::string statevector_file; // .npy output of all_amplitude mode, empty to print the statevector
+    std::vector<std::string> query_states; // basis states whose amplitudes are queried, q0 last
+    std::string query_result; // output of getQueries
     std::string run_output; // output string for Qiskit
 
     unsigned long gatecount;
@@ -105,25 +203,90 @@ private:
     double error;
 
     /* measurement */
-    double get_total_prob(DdNode *node, int kd2, int nVar, int nAnci_fourInt);
-    double measure_probability(DdNode *node, int kd2, int nVar, int nAnci_fourInt, int edge);
-    void measure_one(int position, int kd2, double H_factor, int nVar, int nAnci_fourInt, std::string *outcome);
+    enum { SUM_FREE = -1, SUM_SIGN = 2 }; // modes of a level in tuple_sum besides the fixed values 0 and 1
+    int tuple_root();
+    int tuple_id(const SliceTuple &tuple);
+    void tuple_clear();
+    void tuple_sum_reset();
+    void tuple_cofactor(const SliceRun *tuple, int length, int index, int value, SliceTuple &child);
+    int tuple_child(int id, int position, int value);
+    std::complex<double> tuple_amplitude(const SliceRun *tuple);
+    std::complex<double> tuple_amplitude_gmp(const SliceRun *tuple);
+    double tuple_entry(const SliceRun *tuple);
+    double tuple_prob(int id);
+    double tuple_sum(int id, int position, const std::vector<int> &mode, int last);
+    double expval_group(std::vector<int> &terms);
+    void parse_expval(std::string keyword, std::stringstream &inStr_ss);
+    void parse_expvals(std::vector<std::pair<std::string, std::string>> &expvals);
+    bool load_circuit(const std::string &path, unsigned long long hash, unsigned long long size);
+    void save_circuit(const std::string &path, unsigned long long hash, unsigned long long size);
+    int run_circuit(int pc, std::vector<int> &qubits);
+    bool measured_op(const CircuitOp &op, std::vector<int> &qubits);
+    double frontier_step(const Frontier &frontier, int position, int value, Frontier &next);
+    int frontier_sum(Frontier &frontier, int position, int last);
+    void sample_counts(const Frontier &frontier, int position, int nshots, double p_node, int last, double factor, std::string &outcome);
+    void marginal_probs(const Frontier &frontier, int position, double p_node, int last, double factor, std::string &outcome);
+    double tuple_best(int id);
+    double frontier_bound(const Frontier &frontier, int position);
+    void top_outcomes(int root, int last, double factor);
+    std::string outcome_clbits(const std::string &outcome);
+    void split_branches(const std::vector<int> &qubits, bool isAll);
+    void merge_branches();
+    void load_branch(const Branch &branch);
+    void store_branch(Branch &branch);
+    DdNode ***copy_bdd();
+    void free_bdd(DdNode ***Bdd, int nr);
     void measure_and_collapse(std::unordered_map<int,int>& measured_qubits_to_clbits);
-    void build_bigBDD(int nAnci_oneInt, int nAnci_fourInt);
     void collapse_to(std::unordered_map<int, int>& qubit_to_state, bool reset_to_zero=true);
+    void amplitude_fill(const SliceTuple &tuple, int position, unsigned long long index, const std::vector<int> &level_value, std::vector<SliceTuple> &stack, std::complex<double> *amp);
+    void amplitude_spread(std::complex<double> value, int position, unsigned long long index, const std::vector<int> &level_value, std::complex<double> *amp);
+    void amplitude_worker(const SliceTuple *root, int nsplit, const std::vector<int> *level_value, std::atomic<unsigned long long> *next, std::complex<double> *amp);
+    void amplitude_tables(std::vector<int> &level_value);
+    void decode_amplitudes(std::complex<double> *amp);
+    std::string amplitude_string(std::complex<double> amp);
+    void amplitude_list(const SliceTuple &tuple, int position, std::string &outcome, const std::vector<int> &level_value, std::vector<SliceTuple> &stack, std::complex<double> value);
 
     /* misc */
     void init_state(int *constants);
-    void init_state_by_matrix(int state_k, std::vector<std::vector<int>>& state);
+    void init_state_by_matrix(int state_k, const InitialState &state);
+    void state_bdd(const std::vector<std::pair<unsigned long long, int>> &entries, int lo, int hi, int level, DdNode **out, DdNode **scratch);
+    void init_state_by_op(const CircuitOp &op);
+    void init_state_uniform(DdNode *support, double log2count);
+    DdNode *cube_bdd(const std::vector<int> &value);
+    DdNode *weight_bdd(int weight);
     void alloc_BDD(DdNode ***Bdd, bool extend);
-    void dropLSB(DdNode ***Bdd);
-    int overflow3(DdNode *g, DdNode *h, DdNode *crin);
-    int overflow2(DdNode *g, DdNode *crin);
     void nodecount();
+    int angle_multiple(std::string gate, double unit);
+
+    /* word-level arithmetic */
+    void add_vector(DdNode **g, DdNode **d, DdNode *c, DdNode **Sum, int width = 0);
+    void store_sum(DdNode ***Sum, int width = 0);
+
+    /* gate blocks */
+    std::vector<DdNode *> block_wire;  // wire functions over the block inputs
+    std::vector<DdNode *> block_phase; // exponent of omega, mod 2w
+    std::vector<std::pair<int, std::vector<int>>> block_perm; // (targ, cont) in gate order
+    unsigned long block_ngates;
+    bool is_buffered_op(int code);
+    void flush_gates();
+    void open_block();
+    void block_phase_gate(std::vector<int> qubits, int m);
+    void block_xor(int targ, std::vector<int> cont);
+    void block_toffoli(int targ, std::vector<int> cont);
+    void block_swap(int swapA, int swapB, std::vector<int> cont);
+    void flush_block();
+
+    /* single-qubit runs */
+    enum { GATE_H, GATE_X, GATE_Y, GATE_RX, GATE_RY, GATE_PHASE };
+    std::vector<std::vector<std::vector<int>>> wire_run; // pending {code, m0, m1} of each wire
+    void gate_matrix(std::vector<int> gate, std::vector<std::vector<long long>> &M, int &mk);
+    void gate1(std::vector<int> gate, int iqubit);
+    void flush_wire(int iqubit);
 
-    /* Using VQE */
-    int res;
-    bool usingVQE;
+    /* compiled circuit */
+    CircuitCode Circuit;
+    std::string circuit_cache; // directory of compiled circuits, empty to always compile
+    int res; // resolution of rz angles, pi/res
 
     // Clean up Simulator
     void clear() {
@@ -134,8 +297,9 @@ private:
             delete[] All_Bdd[i];
         delete [] All_Bdd;
         measured_qubits_to_clbits.clear();
+        clbit_writer.clear();
         measure_outcome.clear();
-        Node_Table.clear();
+        tuple_clear();
         state_count.clear();
         Cudd_Quit(manager);
     };
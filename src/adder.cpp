@@ -0,0 +1,134 @@
+#include "Simulator.h"
+#include "util_sim.h"
+
+
+/**Function*************************************************************
+
+  Synopsis    [Word-level addition Sum = g + d + c]
+
+  Description [g and d are two's complement vectors of width bits (r if
+               width is 0; d may be NULL for 0) and c is a 1-bit carry-in. Slices above the highest
+               bit where either operand differs from its sign are not
+               added; their sum is the sign extension of the top computed
+               bit. Each remaining slice costs one Xor3 and one Maj, and
+               the carry stops as soon as it is 0 when d is NULL. Sum
+               receives width + 1 referenced bits, so the result never
+               overflows; see store_sum.]
+
+  SideEffects []
+
+  SeeAlso     [store_sum]
+
+***********************************************************************/
+void Simulator::add_vector(DdNode **g, DdNode **d, DdNode *c, DdNode **Sum, int width)
+{
+    DdNode *tmp, *zero = Cudd_Not(Cudd_ReadOne(manager));
+    if (width == 0)
+        width = r;
+
+    /* bits above nbit only repeat the sign of both operands */
+    int nbit = 1;
+    for (int j = width - 1; j > 0; j--)
+        if (g[j] != g[j - 1] || (d != NULL && d[j] != d[j - 1]))
+        {
+            nbit = j + 1;
+            break;
+        }
+
+    Cudd_Ref(c);
+    for (int j = 0; j <= nbit; j++)
+    {
+        int jo = std::min(j, nbit - 1); // operand bit, sign extended
+        if (d == NULL && c == zero)
+        {
+            Sum[j] = g[jo];
+            Cudd_Ref(Sum[j]);
+            continue;
+        }
+        //sum
+        if (d == NULL)
+            Sum[j] = Cudd_bddXor(manager, g[jo], c);
+        else
+            Sum[j] = Cudd_bddXor3(manager, g[jo], d[jo], c);
+        Cudd_Ref(Sum[j]);
+        //carry
+        if (j < nbit)
+        {
+            if (d == NULL)
+                tmp = Cudd_bddAnd(manager, g[jo], c);
+            else
+                tmp = Cudd_bddMaj(manager, g[jo], d[jo], c);
+            Cudd_Ref(tmp);
+            Cudd_RecursiveDeref(manager, c);
+            c = tmp;
+        }
+    }
+    Cudd_RecursiveDeref(manager, c);
+
+    for (int j = nbit + 1; j <= width; j++)
+    {
+        Sum[j] = Sum[nbit];
+        Cudd_Ref(Sum[j]);
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Replace the state by w sums of width bits]
+
+  Description [width is r + 1 if 0. Overflow is detected once for the
+               whole gate from the top bits of every sum that are not
+               sign extension. On overflow, either inc sign bits are
+               appended (isAlloc) as many times as needed, or the LSBs
+               are dropped and shift is increased.]
+
+  SideEffects [Sum is dereferenced and freed.]
+
+  SeeAlso     [add_vector]
+
+***********************************************************************/
+void Simulator::store_sum(DdNode ***Sum, int width)
+{
+    if (width == 0)
+        width = r + 1;
+
+    // bits from need - 1 up are sign extension in every sum
+    int need = r;
+    for (int i = 0; i < w; i++)
+        for (int j = width - 1; j >= need; j--)
+            if (Sum[i][j] != Sum[i][j - 1])
+            {
+                need = j + 1;
+                break;
+            }
+
+    int nr = r, lsb = 0;
+    if (need > r)
+    {
+        if (isAlloc)
+            nr = r + inc * ((need - r + inc - 1) / inc);
+        else
+        {
+            lsb = need - r;
+            shift += lsb;
+        }
+    }
+
+    for (int i = 0; i < w; i++)
+    {
+        for (int j = 0; j < r; j++)
+            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
+        delete[] All_Bdd[i];
+        All_Bdd[i] = new DdNode *[nr];
+        for (int j = 0; j < nr; j++)
+        {
+            All_Bdd[i][j] = Sum[i][std::min(j + lsb, width - 1)];
+            Cudd_Ref(All_Bdd[i][j]);
+        }
+        for (int j = 0; j < width; j++)
+            Cudd_RecursiveDeref(manager, Sum[i][j]);
+        delete[] Sum[i];
+    }
+    delete[] Sum;
+    r = nr;
+}
@@ -0,0 +1,368 @@
+#include "Simulator.h"
+#include "util_sim.h"
+
+
+/**Function*************************************************************
+
+  Synopsis    [Whether an instruction is buffered instead of applied]
+
+  Description [Diagonal gates, permutation gates and the single-qubit
+               gates; any other instruction flushes all pending gates
+               first.]
+
+  SideEffects []
+
+  SeeAlso     [flush_gates]
+
+***********************************************************************/
+bool Simulator::is_buffered_op(int code)
+{
+    return code >= OP_X;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Apply all pending gates]
+
+  Description [The block comes first, then the run of every wire.]
+
+  SideEffects []
+
+  SeeAlso     [flush_block flush_wire]
+
+***********************************************************************/
+void Simulator::flush_gates()
+{
+    flush_block();
+    for (int q = 0; q < wire_run.size(); q++)
+        flush_wire(q);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Start a pending block if there is none]
+
+  Description [Each wire starts as its own variable over the block
+               inputs, and the exponent of omega starts at 0.]
+
+  SideEffects []
+
+  SeeAlso     [flush_block]
+
+***********************************************************************/
+void Simulator::open_block()
+{
+    if (!block_wire.empty())
+        return;
+
+    int nbit = 1;
+    while ((1 << nbit) < 2 * w)
+        nbit++;
+
+    block_wire.resize(n);
+    for (int q = 0; q < n; q++)
+    {
+        block_wire[q] = Cudd_bddIthVar(manager, q);
+        Cudd_Ref(block_wire[q]);
+    }
+    block_phase.resize(nbit);
+    for (int b = 0; b < nbit; b++)
+    {
+        block_phase[b] = Cudd_Not(Cudd_ReadOne(manager));
+        Cudd_Ref(block_phase[b]);
+    }
+    block_ngates = 0;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Add omega^m to the basis states where all qubits are 1]
+
+  Description [The condition is taken on the current wire functions, so
+               phases behind pending permutation gates see the permuted
+               wires. The exponent is kept modulo 2w since omega^(2w) = 1.
+               An empty qubit list is a global phase and is not counted
+               as a gate.]
+
+  SideEffects []
+
+  SeeAlso     [block_toffoli flush_block]
+
+***********************************************************************/
+void Simulator::block_phase_gate(std::vector<int> qubits, int m)
+{
+    for (int i = 0; i < qubits.size(); i++)
+        flush_wire(qubits[i]);
+    open_block();
+    if (!qubits.empty())
+        block_ngates++;
+
+    int nbit = block_phase.size();
+    m = ((m % (2 * w)) + 2 * w) % (2 * w);
+    if (m == 0)
+        return;
+
+    DdNode *f, *c, *tmp, *addend, *zero = Cudd_Not(Cudd_ReadOne(manager));
+
+    f = Cudd_ReadOne(manager);
+    Cudd_Ref(f);
+    for (int i = 0; i < qubits.size(); i++)
+    {
+        assert((qubits[i] >= 0) & (qubits[i] < n));
+        tmp = Cudd_bddAnd(manager, f, block_wire[qubits[i]]);
+        Cudd_Ref(tmp);
+        Cudd_RecursiveDeref(manager, f);
+        f = tmp;
+    }
+
+    // exponent += m * f, ripple carry over the nbit slices
+    c = zero;
+    Cudd_Ref(c);
+    for (int b = 0; b < nbit; b++)
+    {
+        addend = ((m >> b) & 1) ? f : zero;
+        tmp = Cudd_bddXor3(manager, block_phase[b], addend, c);
+        Cudd_Ref(tmp);
+        if (b < nbit - 1)
+        {
+            DdNode *carry = Cudd_bddMaj(manager, block_phase[b], addend, c);
+            Cudd_Ref(carry);
+            Cudd_RecursiveDeref(manager, c);
+            c = carry;
+        }
+        Cudd_RecursiveDeref(manager, block_phase[b]);
+        block_phase[b] = tmp;
+    }
+    Cudd_RecursiveDeref(manager, c);
+    Cudd_RecursiveDeref(manager, f);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [targ ^= AND(cont) on the wire functions of the block]
+
+  Description [The gate is also recorded, since the inverse of the block
+               is the same update run over the gates in reverse order.]
+
+  SideEffects []
+
+  SeeAlso     [block_toffoli block_swap]
+
+***********************************************************************/
+void Simulator::block_xor(int targ, std::vector<int> cont)
+{
+    DdNode *f, *tmp;
+
+    f = Cudd_ReadOne(manager);
+    Cudd_Ref(f);
+    for (int h = 0; h < cont.size(); h++)
+    {
+        tmp = Cudd_bddAnd(manager, f, block_wire[cont[h]]);
+        Cudd_Ref(tmp);
+        Cudd_RecursiveDeref(manager, f);
+        f = tmp;
+    }
+    tmp = Cudd_bddXor(manager, block_wire[targ], f);
+    Cudd_Ref(tmp);
+    Cudd_RecursiveDeref(manager, f);
+    Cudd_RecursiveDeref(manager, block_wire[targ]);
+    block_wire[targ] = tmp;
+    block_perm.push_back(std::make_pair(targ, cont));
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Add an x, cx or multi-controlled x to the pending block]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [block_swap flush_block]
+
+***********************************************************************/
+void Simulator::block_toffoli(int targ, std::vector<int> cont)
+{
+    assert((targ >= 0) & (targ < n));
+    for (int h = 0; h < cont.size(); h++)
+        assert((cont[h] >= 0) & (cont[h] < n) & (cont[h] != targ));
+    flush_wire(targ);
+    for (int h = 0; h < cont.size(); h++)
+        flush_wire(cont[h]);
+    open_block();
+    block_ngates++;
+
+    block_xor(targ, cont);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Add a swap or controlled swap to the pending block]
+
+  Description [Recorded as cx(b, a) ccx(cont, a, b) cx(b, a).]
+
+  SideEffects []
+
+  SeeAlso     [block_toffoli flush_block]
+
+***********************************************************************/
+void Simulator::block_swap(int swapA, int swapB, std::vector<int> cont)
+{
+    assert((swapA >= 0) & (swapA < n) & (swapB >= 0) & (swapB < n) & (swapA != swapB));
+    flush_wire(swapA);
+    flush_wire(swapB);
+    for (int h = 0; h < cont.size(); h++)
+        flush_wire(cont[h]);
+    open_block();
+    block_ngates++;
+
+    std::vector<int> contB = cont;
+    contB.push_back(swapA);
+    block_xor(swapA, std::vector<int>(1, swapB));
+    block_xor(swapB, contB);
+    block_xor(swapA, std::vector<int>(1, swapB));
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Apply the pending block to the state]
+
+  Description [The state is multiplied by omega^e(x) in one pass, where
+               e is the exponent built from the block inputs: the low
+               bits of e select the rotation of each integer slice, and
+               its top bit (omega^w = -1) together with the slices that
+               wrap around gives the negation, done as complement + 1.
+               The permutation of the block is then applied to every
+               slice with one vector composition by its inverse, unless
+               every wire is back to its own variable.]
+
+  SideEffects []
+
+  SeeAlso     [block_phase_gate block_toffoli block_swap]
+
+***********************************************************************/
+void Simulator::flush_block()
+{
+    if (block_wire.empty())
+        return;
+
+    int nbit = block_phase.size(), nsel = nbit - 1; // w = 2^nsel
+    bool isPhase = false;
+    for (int b = 0; b < nbit; b++)
+        isPhase |= (block_phase[b] != Cudd_Not(Cudd_ReadOne(manager)));
+
+    if (isPhase)
+    {
+        DdNode *tmp, *wrap, *neg;
+        DdNode **g = new DdNode *[r];
+        DdNode **sel = new DdNode *[w];
+        DdNode ***Sum = new DdNode **[w];
+
+        for (int i = 0; i < w; i++)
+        {
+            // wrap = [low bits of e >= w - i]
+            wrap = Cudd_Not(Cudd_ReadOne(manager));
+            Cudd_Ref(wrap);
+            for (int s = w - i; s < w; s++)
+            {
+                DdNode *minterm = Cudd_ReadOne(manager);
+                Cudd_Ref(minterm);
+                for (int b = nsel - 1; b >= 0; b--)
+                {
+                    tmp = Cudd_bddAnd(manager, minterm, Cudd_NotCond(block_phase[b], !((s >> b) & 1)));
+                    Cudd_Ref(tmp);
+                    Cudd_RecursiveDeref(manager, minterm);
+                    minterm = tmp;
+                }
+                tmp = Cudd_bddOr(manager, wrap, minterm);
+                Cudd_Ref(tmp);
+                Cudd_RecursiveDeref(manager, wrap);
+                Cudd_RecursiveDeref(manager, minterm);
+                wrap = tmp;
+            }
+            neg = Cudd_bddXor(manager, wrap, block_phase[nsel]);
+            Cudd_Ref(neg);
+            Cudd_RecursiveDeref(manager, wrap);
+
+            for (int j = 0; j < r; j++)
+            {
+                // multiplexer over the low bits of e: F[i] takes F[(i + s) % w]
+                for (int s = 0; s < w; s++)
+                {
+                    sel[s] = All_Bdd[(i + s) % w][j];
+                    Cudd_Ref(sel[s]);
+                }
+                for (int b = 0, width = w; b < nsel; b++, width /= 2)
+                {
+                    for (int s = 0; s < width / 2; s++)
+                    {
+                        tmp = Cudd_bddIte(manager, block_phase[b], sel[2 * s + 1], sel[2 * s]);
+                        Cudd_Ref(tmp);
+                        Cudd_RecursiveDeref(manager, sel[2 * s]);
+                        Cudd_RecursiveDeref(manager, sel[2 * s + 1]);
+                        sel[s] = tmp;
+                    }
+                }
+                g[j] = Cudd_bddXor(manager, sel[0], neg);
+                Cudd_Ref(g[j]);
+                Cudd_RecursiveDeref(manager, sel[0]);
+            }
+
+            Sum[i] = new DdNode *[r + 1];
+            add_vector(g, NULL, neg, Sum[i]);
+            for (int j = 0; j < r; j++)
+                Cudd_RecursiveDeref(manager, g[j]);
+            Cudd_RecursiveDeref(manager, neg);
+        }
+        store_sum(Sum);
+
+        delete[] g;
+        delete[] sel;
+        nodecount();
+    }
+    gatecount += block_ngates;
+
+    bool isIdentity = true;
+    for (int q = 0; q < n; q++)
+        isIdentity &= (block_wire[q] == Cudd_bddIthVar(manager, q));
+
+    if (!isIdentity)
+    {
+        // the inverse: the same updates over the gates in reverse order
+        for (int q = 0; q < n; q++)
+        {
+            Cudd_RecursiveDeref(manager, block_wire[q]);
+            block_wire[q] = Cudd_bddIthVar(manager, q);
+            Cudd_Ref(block_wire[q]);
+        }
+        std::vector<std::pair<int, std::vector<int>>> perm;
+        perm.swap(block_perm);
+        for (int h = perm.size() - 1; h >= 0; h--)
+            block_xor(perm[h].first, perm[h].second);
+
+        int nvar = Cudd_ReadSize(manager);
+        DdNode **vector = new DdNode *[nvar];
+        for (int v = 0; v < nvar; v++)
+            vector[v] = (v < n) ? block_wire[v] : Cudd_bddIthVar(manager, v);
+
+        DdNode *tmp;
+        for (int i = 0; i < w; i++)
+            for (int j = 0; j < r; j++)
+            {
+                tmp = Cudd_bddVectorCompose(manager, All_Bdd[i][j], vector);
+                Cudd_Ref(tmp);
+                Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
+                All_Bdd[i][j] = tmp;
+            }
+        delete[] vector;
+        nodecount();
+    }
+
+    for (int q = 0; q < n; q++)
+        Cudd_RecursiveDeref(manager, block_wire[q]);
+    for (int b = 0; b < nbit; b++)
+        Cudd_RecursiveDeref(manager, block_phase[b]);
+    block_wire.clear();
+    block_phase.clear();
+    block_perm.clear();
+}
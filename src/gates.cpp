@@ -119,129 +119,6 @@ void Simulator::Toffoli(int targ, std::vector<int> cont, std::vector<int> ncont)
     nodecount();
 }
 
-void Simulator::Fredkin(int swapA , int swapB, std::vector<int> cont)
-{
-    assert(cont.size() < n);
-    int IsBadtarg = 0;
-    for (int i = 0; i < cont.size(); i++)
-    {
-        if ((swapA == cont[i]) || (swapB == cont[i]))
-        {
-            IsBadtarg = 1;
-            break;
-        }
-    }
-    assert(!IsBadtarg);
-
-    DdNode *term1, *term2, *term3, *g, *tmp, *tmp0;
-
-    g = Cudd_ReadOne(manager);
-    Cudd_Ref(g);
-    for (int h = cont.size() - 1; h >= 0; h--)
-    {
-        tmp = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, cont[h]), g);
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, g);
-        g = tmp;
-    }
-
-    for (int i = 0; i < w; i++) // F = All_Bdd[i][j]
-    {
-        for (int j = 0; j < r; j++)
-        {
-            //term1
-            term1 = Cudd_ReadOne(manager);
-            Cudd_Ref(term1);
-            tmp = Cudd_bddAnd(manager, All_Bdd[i][j], term1);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term1);
-            term1 = tmp;
-            tmp = Cudd_bddXor(manager, Cudd_bddIthVar(manager, swapA), Cudd_bddIthVar(manager, swapB));
-            Cudd_Ref(tmp);
-            tmp0 = Cudd_Not(Cudd_bddAnd(manager, g, tmp));
-            Cudd_Ref(tmp0);
-            Cudd_RecursiveDeref(manager, tmp);
-            tmp = Cudd_bddAnd(manager, term1, tmp0);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, tmp0);
-            term1 = tmp;
-
-            //term2
-            term2 = Cudd_Cofactor(manager, All_Bdd[i][j], g);
-            Cudd_Ref(term2);
-
-            tmp = Cudd_Cofactor(manager, term2, Cudd_Not(Cudd_bddIthVar(manager, swapA)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-
-            tmp = Cudd_Cofactor(manager, term2, Cudd_bddIthVar(manager, swapB));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term2, g);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term2, Cudd_bddIthVar(manager, swapA));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term2, Cudd_Not(Cudd_bddIthVar(manager, swapB)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-
-            //term3
-            term3 = Cudd_Cofactor(manager, All_Bdd[i][j], g);
-            Cudd_Ref(term3);
-
-            tmp = Cudd_Cofactor(manager, term3, Cudd_bddIthVar(manager, swapA));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            term3 = tmp;
-
-            tmp = Cudd_Cofactor(manager, term3, Cudd_Not(Cudd_bddIthVar(manager, swapB)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            term3 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term3, g);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            term3 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term3, Cudd_Not(Cudd_bddIthVar(manager, swapA)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            term3 = tmp;
-
-            tmp = Cudd_bddAnd(manager, term3, Cudd_bddIthVar(manager, swapB));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            term3 = tmp;
-
-            //OR
-            All_Bdd[i][j] = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(All_Bdd[i][j]);
-            Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, term2);
-            tmp = Cudd_bddOr(manager, term3, All_Bdd[i][j]);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term3);
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = tmp;
-        }
-    }
-    Cudd_RecursiveDeref(manager, g);
-    gatecount++;
-    nodecount();
-}
-
 void Simulator::Peres(int a, int b, int c)
 {
     std::vector<int> ncont(0);
@@ -282,91 +159,39 @@ void Simulator::Hadamard(int iqubit)
 
     k = k + 1;
 
-    DdNode *g, *d, *c, *tmp, *term1, *term2;
-
-    int overflow_done = 0;
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *term1;
+    DdNode **g = new DdNode *[r];
+    DdNode **d = new DdNode *[r];
+    DdNode ***Sum = new DdNode **[w];
 
     for (int i = 0; i < w; i++) // F = All_Bdd[i][j]
     {
-        c = Cudd_ReadOne(manager); // init c
-        Cudd_Ref(c);
-        tmp = Cudd_bddAnd(manager, c, Cudd_bddIthVar(manager, iqubit));
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, c);
-        c = tmp;
         for (int j = 0; j < r; j++)
         {
             //g
-            g = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(g);
+            g[j] = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_Not(var));
+            Cudd_Ref(g[j]);
             //d
-            term1 = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_bddIthVar(manager, iqubit));
+            term1 = Cudd_Cofactor(manager, All_Bdd[i][j], var);
             Cudd_Ref(term1);
-            tmp = Cudd_bddAnd(manager, term1, Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(tmp);
+            d[j] = Cudd_bddXor(manager, term1, var);
+            Cudd_Ref(d[j]);
             Cudd_RecursiveDeref(manager, term1);
-            term1 = tmp;
-            term2 = Cudd_Not(All_Bdd[i][j]);
-            Cudd_Ref(term2);
-            tmp = Cudd_bddAnd(manager, term2, Cudd_bddIthVar(manager, iqubit));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-            d = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(d);
-            Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, term2);
-            //detect overflow
-            if ((j == r - 1) && !overflow_done)
-                if (overflow3(g, d, c))
-                {   if (isAlloc)
-                    {
-                        r += inc;
-                        alloc_BDD(All_Bdd, true); // add new BDDs
-                    }
-                    else
-                    {
-                        j -= 1;
-                        ++shift;
-                        dropLSB(All_Bdd);
-                    }
-                    overflow_done = 1;
-                }
-            //sum
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = Cudd_bddXor(manager, g, d);
-            Cudd_Ref(All_Bdd[i][j]);
-            tmp = Cudd_bddXor(manager, All_Bdd[i][j], c);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = tmp;
-            //carry
-            if (j == r - 1)
-            {
-                Cudd_RecursiveDeref(manager, c);
-                Cudd_RecursiveDeref(manager, g);
-                Cudd_RecursiveDeref(manager, d);
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, g, d);
-                Cudd_Ref(term1);
-                term2 = Cudd_bddOr(manager, g, d);
-                Cudd_Ref(term2);
-                Cudd_RecursiveDeref(manager, g);
-                Cudd_RecursiveDeref(manager, d);
-                tmp = Cudd_bddAnd(manager, term2, c);
-                Cudd_Ref(tmp);
-                Cudd_RecursiveDeref(manager, term2);
-                Cudd_RecursiveDeref(manager, c);
-                term2 = tmp;
-                c = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(c);
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-            }
+        }
+        //sum: g + d + c, c = x
+        Sum[i] = new DdNode *[r + 1];
+        add_vector(g, d, var, Sum[i]);
+        for (int j = 0; j < r; j++)
+        {
+            Cudd_RecursiveDeref(manager, g[j]);
+            Cudd_RecursiveDeref(manager, d[j]);
         }
     }
+    store_sum(Sum);
+
+    delete[] g;
+    delete[] d;
     gatecount++;
     nodecount();
 }
@@ -378,113 +203,41 @@ void Simulator::rx_pi_2(int iqubit)
     k = k + 1;
 
     int nshift = w / 2;
-    int overflow_done = 0;
-
-    DdNode *g, *d, *c, *tmp, *term1, *term2;
-    DdNode **copy[w];
-    for (int i = 0; i < w; i++)
-        copy[i] = new DdNode *[r];
 
-    /* copy */
-    for (int i = 0; i < w; i++)
-    {
-         for (int j = 0; j < r; j++)
-        {
-            copy[i][j] = Cudd_ReadOne(manager);
-            Cudd_Ref(copy[i][j]);
-            tmp = Cudd_bddAnd(manager, copy[i][j], All_Bdd[i][j]);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-            copy[i][j] = tmp;
-        }
-    }
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *c, *term1, *term2;
+    DdNode **d = new DdNode *[r];
+    DdNode ***Sum = new DdNode **[w];
 
     for (int i = 0; i < w; i++)
     {
         // init c
         if (i < nshift)
             c = Cudd_ReadOne(manager);
-
         else
             c = Cudd_Not(Cudd_ReadOne(manager));
-        Cudd_Ref(c);
         for (int j = 0; j < r; j++)
         {
             //d
-            term1 = Cudd_Cofactor(manager, copy[(i + nshift) % w][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
+            term1 = Cudd_Cofactor(manager, All_Bdd[(i + nshift) % w][j], Cudd_Not(var));
             Cudd_Ref(term1);
-            tmp = Cudd_bddAnd(manager, term1, Cudd_bddIthVar(manager, iqubit));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term1);
-            term1 = tmp;
-            term2 = Cudd_Cofactor(manager, copy[(i + nshift) % w][j], Cudd_bddIthVar(manager, iqubit));
+            term2 = Cudd_Cofactor(manager, All_Bdd[(i + nshift) % w][j], var);
             Cudd_Ref(term2);
-            tmp = Cudd_bddAnd(manager, term2, Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-            if (i < nshift) d = Cudd_Not(Cudd_bddOr(manager, term1, term2));
-            else d = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(d);
+            d[j] = Cudd_bddIte(manager, var, term1, term2);
+            if (i < nshift) d[j] = Cudd_Not(d[j]);
+            Cudd_Ref(d[j]);
             Cudd_RecursiveDeref(manager, term1);
             Cudd_RecursiveDeref(manager, term2);
-            //detect overflow
-            if ((j == r - 1) && !overflow_done)
-                if (overflow3(copy[i][j], d, c))
-                {   if (isAlloc)
-                    {
-                        r += inc;
-                        alloc_BDD(All_Bdd, true); // add new BDDs
-                        alloc_BDD(copy, true);
-                    }
-                    else
-                    {
-                        j -= 1;
-                        ++shift;
-                        dropLSB(All_Bdd);
-                        dropLSB(copy);
-                    }
-                    overflow_done = 1;
-                }
-            //sum
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = Cudd_bddXor(manager, copy[i][j], d);
-            Cudd_Ref(All_Bdd[i][j]);
-            tmp = Cudd_bddXor(manager, All_Bdd[i][j], c);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = tmp;
-            //carry
-            if (j == r - 1)
-            {
-                Cudd_RecursiveDeref(manager, c);
-                Cudd_RecursiveDeref(manager, d);
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, copy[i][j], d);
-                Cudd_Ref(term1);
-                term2 = Cudd_bddOr(manager, copy[i][j], d);
-                Cudd_Ref(term2);
-                Cudd_RecursiveDeref(manager, d);
-                tmp = Cudd_bddAnd(manager, term2, c);
-                Cudd_Ref(tmp);
-                Cudd_RecursiveDeref(manager, term2);
-                Cudd_RecursiveDeref(manager, c);
-                term2 = tmp;
-                c = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(c);
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-            }
         }
-    }
-    for (int i = 0; i < w; i++)
-    {
+        //sum
+        Sum[i] = new DdNode *[r + 1];
+        add_vector(All_Bdd[i], d, c, Sum[i]);
         for (int j = 0; j < r; j++)
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-        delete[] copy[i];
+            Cudd_RecursiveDeref(manager, d[j]);
     }
+    store_sum(Sum);
+
+    delete[] d;
     gatecount++;
     nodecount();
 }
@@ -496,330 +249,96 @@ void Simulator::ry_pi_2(int iqubit)
 
     k = k + 1;
 
-    int overflow_done = 0;
-
-    DdNode *g, *d, *c, *tmp, *term1, *term2;
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *term1;
+    DdNode **g = new DdNode *[r];
+    DdNode **d = new DdNode *[r];
+    DdNode ***Sum = new DdNode **[w];
 
     for (int i = 0; i < w; i++)
     {
-        c = Cudd_ReadOne(manager); // init c
-        Cudd_Ref(c);
-        tmp = Cudd_bddAnd(manager, c, Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, c);
-        c = tmp;
         for (int j = 0; j < r; j++)
         {
             //g
-            g = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(g);
+            g[j] = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_Not(var));
+            Cudd_Ref(g[j]);
             //d
-            term1 = Cudd_bddAnd(manager, All_Bdd[i][j], Cudd_bddIthVar(manager, iqubit));
+            term1 = Cudd_Cofactor(manager, All_Bdd[i][j], var);
             Cudd_Ref(term1);
-            term2 = Cudd_Not(Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(term2);
-            tmp = Cudd_bddAnd(manager, term2, Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-            d = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(d);
+            d[j] = Cudd_bddXnor(manager, term1, var);
+            Cudd_Ref(d[j]);
             Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, term2);
-
-            //detect overflow
-            if ((j == r - 1) && !overflow_done)
-                if (overflow3(g, d, c))
-                {   if (isAlloc)
-                    {
-                        r += inc;
-                        alloc_BDD(All_Bdd, true); // add new BDDs
-                    }
-                    else
-                    {
-                        j -= 1;
-                        ++shift;
-                        dropLSB(All_Bdd);
-                    }
-                    overflow_done = 1;
-                }
-            //sum
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = Cudd_bddXor(manager, g, d);
-            Cudd_Ref(All_Bdd[i][j]);
-            tmp = Cudd_bddXor(manager, All_Bdd[i][j], c);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = tmp;
-            //carry
-            if (j == r - 1)
-            {
-                Cudd_RecursiveDeref(manager, c);
-                Cudd_RecursiveDeref(manager, g);
-                Cudd_RecursiveDeref(manager, d);
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, g, d);
-                Cudd_Ref(term1);
-                term2 = Cudd_bddOr(manager, g, d);
-                Cudd_Ref(term2);
-                Cudd_RecursiveDeref(manager, g);
-                Cudd_RecursiveDeref(manager, d);
-                tmp = Cudd_bddAnd(manager, term2, c);
-                Cudd_Ref(tmp);
-                Cudd_RecursiveDeref(manager, term2);
-                Cudd_RecursiveDeref(manager, c);
-                term2 = tmp;
-                c = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(c);
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-            }
         }
-    }
-    gatecount++;
-    nodecount();
-}
-
-void Simulator::Phase_shift(int phase, int iqubit)
-{
-    assert((iqubit >= 0) & (iqubit < n));
-
-    int nshift = w / phase;
-    int overflow_done = 0;
-
-    DdNode *g, *c, *tmp, *term1, *term2;
-
-    /* copy */
-    DdNode **copy[w];
-    for (int i = 0; i < w; i++)
-        copy[i] = new DdNode *[r];
-    for (int i = 0; i < w; i++)
-    {
-         for (int j = 0; j < r; j++)
-        {
-            copy[i][j] = Cudd_ReadOne(manager);
-            Cudd_Ref(copy[i][j]);
-            tmp = Cudd_bddAnd(manager, copy[i][j], All_Bdd[i][j]);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-            copy[i][j] = tmp;
-        }
-    }
-
-    for (int i = 0; i < w; i++)
-    {
-        // init c
-        if (i >= w - nshift)
-        {
-            c = Cudd_bddIthVar(manager, iqubit);
-            Cudd_Ref(c);
-        }
-
+        //sum: g + d + c, c = x'
+        Sum[i] = new DdNode *[r + 1];
+        add_vector(g, d, Cudd_Not(var), Sum[i]);
         for (int j = 0; j < r; j++)
         {
-            if (i >= w - nshift)
-            {
-                term1 = Cudd_bddAnd(manager, copy[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, Cudd_Not(copy[i - (w - nshift)][j]), Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term2);
-                g = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(g);
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-
-                //detect overflow
-                if ((j == r - 1) && !overflow_done)
-                    if (overflow2(g, c))
-                    {   if (isAlloc)
-                        {
-                            r += inc;
-                            alloc_BDD(All_Bdd, true);
-                            alloc_BDD(copy, true);      // add new BDDs
-                        }
-                        else
-                        {
-                            j -= 1;
-                            ++shift;
-                            dropLSB(All_Bdd);
-                            dropLSB(copy);
-                        }
-                        overflow_done = 1;
-                    }
-
-                /* plus */
-                Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-                if (Cudd_IsConstant(c))     // must be constant 0
-                    All_Bdd[i][j] = g;
-                else
-                {
-                    /* sum */
-                    All_Bdd[i][j] = Cudd_bddXor(manager, g, c);
-                    Cudd_Ref(All_Bdd[i][j]);
-                    /*carry*/
-                    if (j == r - 1)
-                    {
-                        Cudd_RecursiveDeref(manager, g);
-                        Cudd_RecursiveDeref(manager, c);
-                    }
-                    else
-                    {
-                        tmp = Cudd_bddAnd(manager, g, c);
-                        Cudd_Ref(tmp);
-                        Cudd_RecursiveDeref(manager, g);
-                        Cudd_RecursiveDeref(manager, c);
-                        c = tmp;
-                    }
-                }
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, copy[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, copy[i + nshift][j], Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term2);
-
-                Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-                All_Bdd[i][j] = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(All_Bdd[i][j]);
-
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-            }
+            Cudd_RecursiveDeref(manager, g[j]);
+            Cudd_RecursiveDeref(manager, d[j]);
         }
     }
+    store_sum(Sum);
 
-    for (int i = 0; i < w; i++)
-    {
-        for (int j = 0; j < r; j++)
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-        delete[] copy[i];
-    }
+    delete[] g;
+    delete[] d;
     gatecount++;
     nodecount();
 }
 
-void Simulator::Phase_shift_dagger(int phase, int iqubit)
+void Simulator::Phase_rotate(int m0, int m1, int iqubit)
 {
     assert((iqubit >= 0) & (iqubit < n));
 
-    int nshift = w / abs(phase);
-    int overflow_done = 0;
-
-    DdNode *g, *c, *tmp, *term1, *term2;
+    // omega^w = -1, so the rotations are taken modulo 2w
+    m0 = ((m0 % (2 * w)) + 2 * w) % (2 * w);
+    m1 = ((m1 % (2 * w)) + 2 * w) % (2 * w);
 
-    /* copy */
-    DdNode **copy[w];
-    for (int i = 0; i < w; i++)
-        copy[i] = new DdNode *[r];
-    for (int i = 0; i < w; i++)
-    {
-         for (int j = 0; j < r; j++)
-        {
-            copy[i][j] = Cudd_ReadOne(manager);
-            Cudd_Ref(copy[i][j]);
-            tmp = Cudd_bddAnd(manager, copy[i][j], All_Bdd[i][j]);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-            copy[i][j] = tmp;
-        }
-    }
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *c;
+    DdNode **g = new DdNode *[r];
+    DdNode ***Sum = new DdNode **[w];
 
     for (int i = 0; i < w; i++)
     {
-        // init c
-        if (i < nshift)
-        {
-            c = Cudd_bddIthVar(manager, iqubit);
-            Cudd_Ref(c);
-        }
+        // F[i] takes F[i + m] of each branch, negated when it wraps around omega^w
+        int src0 = (i + m0) % w, src1 = (i + m1) % w;
+        bool neg0 = ((i + m0) / w) % 2, neg1 = ((i + m1) / w) % 2;
 
         for (int j = 0; j < r; j++)
         {
-            if (i < nshift)
-            {
-                term1 = Cudd_bddAnd(manager, copy[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, Cudd_Not(copy[w - nshift + i][j]), Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term2);
-                g = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(g);
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-
-                //detect overflow
-                if ((j == r - 1) && !overflow_done)
-                    if (overflow2(g, c))
-                    {   if (isAlloc)
-                        {
-                            r += inc;
-                            alloc_BDD(All_Bdd, true);
-                            alloc_BDD(copy, true);      // add new BDDs
-                        }
-                        else
-                        {
-                            j -= 1;
-                            ++shift;
-                            dropLSB(All_Bdd);
-                            dropLSB(copy);
-                        }
-                        overflow_done = 1;
-                    }
-
-                /* plus */
-                Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-                if (Cudd_IsConstant(c))     // must be constant 0
-                    All_Bdd[i][j] = g;
-                else
-                {
-                    /* sum */
-                    All_Bdd[i][j] = Cudd_bddXor(manager, g, c);
-                    Cudd_Ref(All_Bdd[i][j]);
-                    /*carry*/
-                    if (j == r - 1)
-                    {
-                        Cudd_RecursiveDeref(manager, g);
-                        Cudd_RecursiveDeref(manager, c);
-                    }
-                    else
-                    {
-                        tmp = Cudd_bddAnd(manager, g, c);
-                        Cudd_Ref(tmp);
-                        Cudd_RecursiveDeref(manager, g);
-                        Cudd_RecursiveDeref(manager, c);
-                        c = tmp;
-                    }
-                }
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, copy[i][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, copy[i - nshift][j], Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term2);
-
-                Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-                All_Bdd[i][j] = Cudd_bddOr(manager, term1, term2);
-                Cudd_Ref(All_Bdd[i][j]);
-
-                Cudd_RecursiveDeref(manager, term1);
-                Cudd_RecursiveDeref(manager, term2);
-            }
+            g[j] = Cudd_bddIte(manager, var, Cudd_NotCond(All_Bdd[src1][j], neg1), Cudd_NotCond(All_Bdd[src0][j], neg0));
+            Cudd_Ref(g[j]);
         }
-    }
+        // negated as complement + c
+        if (neg0)
+            c = neg1 ? Cudd_ReadOne(manager) : Cudd_Not(var);
+        else
+            c = neg1 ? var : Cudd_Not(Cudd_ReadOne(manager));
 
-    for (int i = 0; i < w; i++)
-    {
+        Sum[i] = new DdNode *[r + 1];
+        add_vector(g, NULL, c, Sum[i]);
         for (int j = 0; j < r; j++)
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-        delete[] copy[i];
+            Cudd_RecursiveDeref(manager, g[j]);
     }
+    store_sum(Sum);
+
+    delete[] g;
     gatecount++;
     nodecount();
 }
 
+void Simulator::rz(int m, int iqubit)
+{
+    // rz(m*pi/res) = diag(omega^-m, omega^m) since w = 2 * res
+    Phase_rotate(-m, m, iqubit);
+}
+
+void Simulator::u1(int m, int iqubit)
+{
+    Phase_rotate(0, m, iqubit);
+}
+
 void Simulator::PauliX(int iqubit)
 {
     assert((iqubit >= 0) & (iqubit < n));
@@ -875,198 +394,37 @@ void Simulator::PauliY(int iqubit)
 
     int nshift = w / 2;
 
-    DdNode *g, *c, *tmp, *term1, *term2;
-    int overflow_done = 0;
-
-    /* copy */
-    DdNode **copy[w];
-    for (int i = 0; i < w; i++)
-        copy[i] = new DdNode *[r];
-    for (int i = 0; i < w; i++)
-    {
-         for (int j = 0; j < r; j++)
-        {
-            copy[i][j] = Cudd_ReadOne(manager);
-            Cudd_Ref(copy[i][j]);
-            tmp = Cudd_bddAnd(manager, copy[i][j], All_Bdd[i][j]);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-            copy[i][j] = tmp;
-        }
-    }
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *c;
+    DdNode **g = new DdNode *[r];
+    DdNode ***Sum = new DdNode **[w];
 
     for (int i = 0; i < w; i++)
     {
         // init c
         if (i < nshift)
-            c = Cudd_Not(Cudd_bddIthVar(manager, iqubit));
+            c = Cudd_Not(var);
         else
-            c = Cudd_bddIthVar(manager, iqubit);
-        Cudd_Ref(c);
+            c = var;
 
         for (int j = 0; j < r; j++)
         {
             if (i < nshift)
-            {
-                term1 = Cudd_bddAnd(manager, copy[i + nshift][j], Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, Cudd_Not(copy[i + nshift][j]), Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term2);
-            }
-            else
-            {
-                term1 = Cudd_bddAnd(manager, Cudd_Not(copy[i - nshift][j]), Cudd_bddIthVar(manager, iqubit));
-                Cudd_Ref(term1);
-                term2 = Cudd_bddAnd(manager, copy[i - nshift][j], Cudd_Not(Cudd_bddIthVar(manager, iqubit)));
-                Cudd_Ref(term2);
-            }
-            g = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(g);
-            Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, term2);
-
-            //detect overflow
-            if ((j == r - 1) && !overflow_done)
-                if (overflow2(g, c))
-                {   if (isAlloc)
-                    {
-                        r += inc;
-                        alloc_BDD(All_Bdd, true);
-                        alloc_BDD(copy, true);      // add new BDDs
-                    }
-                    else
-                    {
-                        j -= 1;
-                        ++shift;
-                        dropLSB(All_Bdd);
-                        dropLSB(copy);
-                    }
-                    overflow_done = 1;
-                }
-
-            /* plus 1*/
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            if (Cudd_IsConstant(c))
-                All_Bdd[i][j] = g;
+                g[j] = Cudd_bddXnor(manager, All_Bdd[i + nshift][j], var);
             else
-            {
-                /* sum */
-                All_Bdd[i][j] = Cudd_bddXor(manager, g, c);
-                Cudd_Ref(All_Bdd[i][j]);
-                /*carry*/
-                if (j == r - 1)
-                {
-                    Cudd_RecursiveDeref(manager, g);
-                    Cudd_RecursiveDeref(manager, c);
-                }
-                else
-                {
-                    tmp = Cudd_bddAnd(manager, g, c);
-                    Cudd_Ref(tmp);
-                    Cudd_RecursiveDeref(manager, g);
-                    Cudd_RecursiveDeref(manager, c);
-                    c = tmp;
-                }
-            }
+                g[j] = Cudd_bddXor(manager, All_Bdd[i - nshift][j], var);
+            Cudd_Ref(g[j]);
         }
-    }
 
-    for (int i = 0; i < w; i++)
-    {
+        /* plus 1*/
+        Sum[i] = new DdNode *[r + 1];
+        add_vector(g, NULL, c, Sum[i]);
         for (int j = 0; j < r; j++)
-            Cudd_RecursiveDeref(manager, copy[i][j]);
-        delete[] copy[i];
+            Cudd_RecursiveDeref(manager, g[j]);
     }
-    gatecount++;
-    nodecount();
-}
+    store_sum(Sum);
 
-void Simulator::PauliZ(std::vector<int> iqubit)
-{
-    for (int i = 0; i < iqubit.size(); i++)
-    {
-        assert((iqubit[i] >= 0) & (iqubit[i] < n));
-    }
-    assert((iqubit.size() == 1) || (iqubit.size() == 2));
-
-    DdNode *c, *tmp, *term1, *term2, *inter, *qubit_and;
-    int overflow_done = 0;
-
-    qubit_and = Cudd_ReadOne(manager); // init qubit_and
-    Cudd_Ref(qubit_and);
-    for (int i = iqubit.size() - 1; i >= 0; i--)
-    {
-        tmp = Cudd_bddAnd(manager, qubit_and, Cudd_bddIthVar(manager, iqubit[i]));
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, qubit_and);
-        qubit_and = tmp;
-    }
-
-    for (int i = 0; i < w; i++)
-    {
-        c = Cudd_ReadOne(manager); // init c
-        Cudd_Ref(c);
-        tmp = Cudd_bddAnd(manager, c, qubit_and);
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, c);
-        c = tmp;
-        for (int j = 0; j < r; j++)
-        {
-            term1 = Cudd_bddAnd(manager, All_Bdd[i][j], Cudd_Not(qubit_and));
-            Cudd_Ref(term1);
-            term2 = Cudd_Not(All_Bdd[i][j]);
-            Cudd_Ref(term2);
-            tmp = Cudd_bddAnd(manager, term2, qubit_and);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, term2);
-            term2 = tmp;
-            inter = Cudd_bddOr(manager, term1, term2);
-            Cudd_Ref(inter);
-            Cudd_RecursiveDeref(manager, term1);
-            Cudd_RecursiveDeref(manager, term2);
-
-            //detect overflow
-            if ((j == r - 1) && !overflow_done)
-                if (overflow2(inter, c))
-                {   if (isAlloc)
-                    {
-                        r += inc;
-                        alloc_BDD(All_Bdd, true); // add new BDDs
-                    }
-                    else
-                    {
-                        j -= 1;
-                        ++shift;
-                        dropLSB(All_Bdd);
-                    }
-                    overflow_done = 1;
-                }
-
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            /* plus 1*/
-            if (Cudd_IsConstant(c))
-                All_Bdd[i][j] = inter;
-            else
-            {
-                /* sum */
-                All_Bdd[i][j] = Cudd_bddXor(manager, inter, c);
-                Cudd_Ref(All_Bdd[i][j]);
-                /*carry*/
-                if (j == r - 1)
-                    Cudd_RecursiveDeref(manager, inter);
-                else
-                {
-                    tmp = Cudd_bddAnd(manager, inter, c);
-                    Cudd_Ref(tmp);
-                    Cudd_RecursiveDeref(manager, c);
-                    Cudd_RecursiveDeref(manager, inter);
-                    c = tmp;
-                }
-            }
-        }
-        Cudd_RecursiveDeref(manager, c);
-    }
-    Cudd_RecursiveDeref(manager, qubit_and);
+    delete[] g;
     gatecount++;
     nodecount();
 }
@@ -1075,6 +433,9 @@ void Simulator::measure(int qreg, int creg)
 {
     assert(creg < nClbits);
     measured_qubits_to_clbits[qreg].push_back(creg);
+    if (clbit_writer.size() < nClbits)
+        clbit_writer.resize(nClbits, -1);
+    clbit_writer[creg] = qreg; // a later measure into creg overrides this one, whichever is resolved first
 }
 
 void Simulator::RUS(std::vector<int> mqubits, std::vector<int> cond){
@@ -1,6 +1,10 @@
 #include <boost/program_options.hpp>
 #include "Simulator.h"
 #include "util_sim.h"
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
 
 int main(int argc, char **argv)
 {
@@ -13,8 +17,15 @@ int main(int argc, char **argv)
     ("print_info", "print simulation statistics such as runtime, memory, etc.")
     ("type", po::value<unsigned int>()->default_value(0), "the simulation type being executed.\n"
                                                            "0: sampling mode (default option), where the sampled outcomes will be provided. \n"
-                                                           "1: all_amplitude mode, where the final state vector will be shown. ")
+                                                           "1: all_amplitude mode, where the final state vector will be shown. \n"
+                                                           "2: probability mode, where the exact distribution of the measurement outcomes will be shown. \n"
+                                                           "3: sparse_amplitude mode, where only the nonzero amplitudes of the final state will be shown. ")
+    ("statevector_file", po::value<std::string>(), "in \"all_amplitude mode\", write the final state vector to this .npy file (complex128) instead of printing it.")
+    ("query", po::value<std::string>(), "comma-separated basis states (q0 last) whose exact amplitudes and probabilities will be shown.")
     ("shots", po::value<unsigned int>()->default_value(1), "the number of outcomes being sampled in \"sampling mode\". " )
+    ("top_k", po::value<unsigned int>(), "in \"sampling mode\", show the k most probable outcomes with their exact probabilities instead of sampled outcomes.")
+    ("stream", "with the qasm file read from stdin, simulate it while it is being read instead of reading it all first.")
+    ("circuit_cache", po::value<std::string>(), "directory where compiled circuits are kept, so later runs of the same qasm file skip parsing.")
     ("r", po::value<unsigned int>()->default_value(32), "integer bit size.")
     ("reorder", po::value<bool>()->default_value(1), "allow variable reordering or not.\n"
                                                              "0: disable reordering.\n"
@@ -25,7 +36,10 @@ int main(int argc, char **argv)
     ("res", po::value<unsigned int>()->default_value(4), "define the resolution of rz gate angle.\n"
                                                          "The input parameter should be the power of 2.\n"
                                                          "4: use default 4 integers representation.\n"
-                                                         "other : incresed BDD numbers to support the resolution.")
+                                                         "other : incresed BDD numbers to support the resolution.\n"
+                                                         "With res integers, rz(k*pi/(res/2)) and u1/p(k*pi/res) are applied exactly.")
+    ("rz_res", po::value<unsigned int>(), "resolution of rz angles, a power of 2: rz(k*pi/rz_res) and u1/p(k*pi/(2*rz_res)) are applied exactly.\n"
+                                          "Same as --res 2*rz_res.")
     ;
 
     po::variables_map vm;
@@ -57,29 +71,75 @@ int main(int argc, char **argv)
     assert(shots > 0);
     Simulator simulator(type, shots, seed, r, isReorder, isAlloc);
 
-    // using VQE
+    // resolution of rz gates: --res counts the integers of an amplitude, twice the rz resolution
     int res = vm["res"].as<unsigned int>();
-    bool usingVQE = (res != 4);
+    if (vm.count("rz_res"))
+    {
+        if (!vm["res"].defaulted() && res != 2 * vm["rz_res"].as<unsigned int>())
+        {
+            std::cerr << "[error]--res " << res << " does not match --rz_res " << vm["rz_res"].as<unsigned int>() << ", which needs --res " << 2 * vm["rz_res"].as<unsigned int>() << std::endl;
+            std::exit(1);
+        }
+        res = 2 * vm["rz_res"].as<unsigned int>();
+    }
+    if (res < 4 || (res & (res - 1)) != 0)
+    {
+        std::cerr << "[error]--res should be a power of 2 of at least 4, and --rz_res one of at least 2" << std::endl;
+        std::exit(1);
+    }
 
     if (vm.count("sim_qasm"))
     {
-        // read in file into a string
-        std::stringstream strStream;
-        if (vm["sim_qasm"].as<std::string>() == "")
+        simulator.setVQEParam(res / 2);
+        if (vm.count("statevector_file"))
+            simulator.setStatevectorFile(vm["statevector_file"].as<std::string>());
+        if (vm.count("query"))
+            simulator.setQuery(vm["query"].as<std::string>());
+        if (vm.count("top_k"))
+            simulator.setTopK(vm["top_k"].as<unsigned int>());
+        if (vm.count("circuit_cache"))
+            simulator.setCircuitCache(vm["circuit_cache"].as<std::string>());
+
+        // the file is mapped and compiled in place, stdin is read into a string or streamed
+        if (vm["sim_qasm"].as<std::string>() == "" && vm.count("stream"))
         {
+            simulator.sim_qasm_stream(std::cin);
+        }
+        else if (vm["sim_qasm"].as<std::string>() == "")
+        {
+            std::stringstream strStream;
             strStream << std::cin.rdbuf();
+            std::string inFile_str = strStream.str();
+            simulator.sim_qasm(inFile_str.data(), inFile_str.size());
         }
         else
         {
-            std::ifstream inFile;
-            inFile.open(vm["sim_qasm"].as<std::string>()); //open the input file
-            strStream << inFile.rdbuf(); //read the file
+            std::string path = vm["sim_qasm"].as<std::string>();
+            if (vm.count("stream"))
+                std::cout << "Warning: the --stream argument is only used when the qasm file is read from stdin.\n" << std::flush;
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0)
+            {
+                std::cerr << "[error]Cannot open " << path << std::endl;
+                std::exit(1);
+            }
+            const char *qasm = "";
+            if (st.st_size > 0)
+            {
+                void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED)
+                {
+                    std::cerr << "[error]Cannot map " << path << std::endl;
+                    std::exit(1);
+                }
+                qasm = (const char *) map;
+            }
+            close(fd);
+            simulator.sim_qasm(qasm, st.st_size);
+            if (st.st_size > 0)
+                munmap((void *) qasm, st.st_size);
         }
-
-        std::string inFile_str = strStream.str(); //str holds the content of the file
-        if (usingVQE)
-            simulator.setVQEParam(res, usingVQE);
-        simulator.sim_qasm(inFile_str);
     }
 
     //end timer
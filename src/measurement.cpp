@@ -1,178 +1,47 @@
 #include "Simulator.h"
 #include "util_sim.h"
-#include <gmpxx.h>
+#include <thread>
+#include <queue>
+#include <algorithm> // sort
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <unistd.h> // ftruncate
 
 /**Function*************************************************************
 
   Synopsis    [measure a specific qubit and collapse to a specific state]
 
-  Description []
+  Description [The probability of the outcome is one traversal with the
+               measured qubits fixed; no qubit has to be moved.]
                
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [tuple_sum collapse_to]
 
 ***********************************************************************/
 void Simulator::measure_and_collapse(std::unordered_map<int, int> &qubit_to_state){
     double oneroot2 = 1 / sqrt(2);
     double H_factor = pow(oneroot2, k%2);
-    int nAnci_oneInt = ceil(log(r) / log(2)), nAnci_fourInt = ceil(log(w) / log(2));
-    int nVar = n + nAnci_oneInt + nAnci_fourInt;
-    build_bigBDD(nAnci_oneInt, nAnci_fourInt);
-    // move measured qubits to the top
-    int *permutation = new int[nVar];
-    int indCount1 = 0;
-    int indCount0 = qubit_to_state.size();  // number of measured qubits
-    int first_index;
-    for (int i = 0; i < n; i++)
+    std::vector<int> mode(n, SUM_FREE);
+    int last = -1; // lowest level that is not summed freely
+    std::unordered_map<int, int>::iterator it;
+    for (it = qubit_to_state.begin(); it != qubit_to_state.end(); it++)
     {
-        int index = Cudd_ReadInvPerm(manager, i);
-        if (qubit_to_state.find(index)!=qubit_to_state.end())
-        {
-            permutation[indCount1] = index;
-            indCount1++;
-        }
-        else
-        {
-            permutation[indCount0] = index;
-            indCount0++;
-        }
+        mode[it->first] = it->second;
+        last = std::max(last, Cudd_ReadPerm(manager, it->first));
     }
-    for(int i=n;i<nVar;i++)
-        permutation[i] = Cudd_ReadInvPerm(manager, i);
-    
-    int dum = Cudd_ShuffleHeap(manager, permutation);    
-    nodecount();
 
-    int comple;
-    int noNode_f = 0; //flag: 1 if the node we want to measure is reduced
-    int state_of_qubit;
-	double p;
-    DdNode *node, *tmp;
-    
-    Cudd_Ref(bigBDD); // if this line is not added, there might be some error in CUDD.
-
-    /* traverse until the qubit measured */
-    comple = Cudd_IsComplement(bigBDD);
-    tmp = Cudd_Regular(bigBDD);
-    std::unordered_map<int, int>::iterator it;
-    p=1.0;
-    while (it=qubit_to_state.find(tmp->index), it!=qubit_to_state.end())
-    {
-        node = Cudd_NotCond(tmp, comple);
-        state_of_qubit = it->second;
-        
-        
-        if (cuddIsConstant(tmp))
-        {
-            noNode_f = 1;
-            //? not sure if this is correct here
-            break;
-        }
-        if (it->second == 1)
-        {
-            tmp = cuddT(tmp);
-        }
-        else
-        {
-            comple ^= Cudd_IsComplement(cuddE(tmp));
-            tmp = Cudd_Regular(cuddE(tmp));
-        }
-    }
-    Cudd_Ref(node);
-    p = measure_probability(node, k/2, nVar,nAnci_fourInt, state_of_qubit) * H_factor *
+    int root = tuple_root();
+    tuple_sum_reset();
+    double p = tuple_sum(root, 0, mode, last) * H_factor *
             H_factor * normalize_factor * normalize_factor * rus_normalize_factor * rus_normalize_factor;
-    Cudd_RecursiveDeref(manager, node);
+    tuple_clear();
 
     rus_normalize_factor /= sqrt(p);
     collapse_to(qubit_to_state, true);
-    Cudd_RecursiveDeref(manager, bigBDD);
-    delete[] permutation;
     nodecount();
 }
 
-
-void Simulator::build_bigBDD(int nAnci_oneInt, int nAnci_fourInt){
-    double oneroot2 = 1 / sqrt(2);
-    double H_factor = pow(oneroot2, k%2);
-    int nAnci = nAnci_oneInt + nAnci_fourInt, nnAnci_fourInt = n + nAnci_fourInt, nVar = n + nAnci;
-    DdNode *tmp1, *tmp2, *tmp3;
-
-    if (isReorder) Cudd_AutodynDisable(manager);
-    
-    int *arrAnci_fourInt = new int[nAnci_fourInt];
-    for (int i = 0; i < nAnci_fourInt; i++)
-        arrAnci_fourInt[i] = 0;// a bit string
-    int *arrAnci_oneInt = new int[nAnci_oneInt];
-    for (int i = 0; i < nAnci_oneInt; i++)
-        arrAnci_oneInt[i] = 0;// a bit string, record the index of bit(BDD of an integer)?
-    
-    bigBDD = Cudd_Not(Cudd_ReadOne(manager));
-    Cudd_Ref(bigBDD);
-    // * Note that Cudd_bddIthVar will automatically create new nodes if it does not exist.
-    for (int i = 0; i < w; i++)// for all integers
-    {
-        tmp3 = Cudd_Not(Cudd_ReadOne(manager));
-        Cudd_Ref(tmp3);
-        for (int j = 0; j < r; j++)// for all bits
-        {
-            tmp1 = Cudd_ReadOne(manager);
-            Cudd_Ref(tmp1);
-            for (int h = n + nAnci - 1; h >= nnAnci_fourInt; h--)// add ancilla bits with value from arrAnci_fourInt, i.e., BDD's index
-            {
-                if (arrAnci_oneInt[h - nnAnci_fourInt])
-                    tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, h), tmp1);
-                else
-                    tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, h)), tmp1);
-                Cudd_Ref(tmp2);
-                Cudd_RecursiveDeref(manager, tmp1);
-                tmp1 = tmp2;
-            }
-            tmp2 = Cudd_bddAnd(manager, All_Bdd[i][j], tmp1);// AND with the target BDD, i.e., the BDD is (allowed to be) one when the index is assigned to it.
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            // Cudd_RecursiveDeref(manager, All_Bdd[i][j]); // keep these BDDs for statevector after measurement
-            tmp1 = tmp2;
-            tmp2 = Cudd_bddOr(manager, tmp3, tmp1);// OR with this integer/id. I.e., the BDD is one when the var is valid index
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-
-            Cudd_RecursiveDeref(manager, tmp3);
-            tmp3 = tmp2;
-            full_adder_plus_1(nAnci_oneInt, arrAnci_oneInt);
-        }
-        tmp1 = Cudd_ReadOne(manager);
-        Cudd_Ref(tmp1);
-        // similarly, add ancilla bits with value from arrAnci_fourInt(integers' index)
-        for (int j = nnAnci_fourInt - 1; j >= n; j--)
-        {
-            if (arrAnci_fourInt[j - n])
-                tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, j), tmp1);
-            else
-                tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, j)), tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            tmp1 = tmp2;
-        }
-        tmp2 = Cudd_bddAnd(manager, tmp3, tmp1);// the BDD is True when valid BDD index and integer index
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, tmp3);
-        tmp1 = tmp2;
-        tmp2 = Cudd_bddOr(manager, bigBDD, tmp1);// ORed into the bigBDD
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, bigBDD);
-        bigBDD = tmp2;
-        full_adder_plus_1(nAnci_fourInt, arrAnci_fourInt);
-        for (int j = 0; j < nAnci_oneInt; j++) // reset array: not necessary but straightforward
-            arrAnci_oneInt[j] = 0;
-    }
-    nodecount();
-    
-    delete[] arrAnci_fourInt;
-    delete[] arrAnci_oneInt;
-}
 /**Function*************************************************************
 
   Synopsis    [collapse to a specific state]
@@ -214,771 +83,1536 @@ void Simulator::collapse_to(std::unordered_map<int, int>& qubit_to_state, bool r
     }
 }
 
-
 /**Function*************************************************************
 
-  Synopsis    [calculate probabilities for measurement]
+  Synopsis    [Branch every state of the run on the measured qubits]
 
-  Description []
+  Description [The measurements pending on qubits are done now, one
+               qubit at a time: each state is collapsed to both values
+               of the qubit, and each record of the clbits measured so
+               far splits its shots between them with one binomial draw,
+               as in sample_counts. A value no shot reaches is dropped
+               unless isAll, i.e. the exact distribution or an expectation
+               value needs every outcome. In the amplitude modes the run
+               keeps one shot, so it follows one outcome. A clbit is only
+               written by the qubit of its last measure in program order,
+               see clbit_writer, so the order of the qubits does not
+               matter.]
 
-  SideEffects []
+  SideEffects [Sets branches; the simulator is left at one of them.]
 
-  SeeAlso     []
+  SeeAlso     [sim_circuit merge_branches]
 
 ***********************************************************************/
-double Simulator::measure_probability(DdNode *node, int kd2, int nVar, int nAnci_fourInt, int edge)
+void Simulator::split_branches(const std::vector<int> &qubits, bool isAll)
 {
-    double then_edge, else_edge, probability;
-    double re, im;
-    DdNode *child = Cudd_Child(manager, node, edge);
-    Cudd_Ref(child);
-    int position_node = Cudd_ReadPerm(manager, Cudd_NodeReadIndex(node)), position_child = Cudd_ReadPerm(manager, Cudd_NodeReadIndex(child));
-    int skip_level;
-    std::unordered_map<DdNode *, double>::iterator it;
-    it = Node_Table.find(child);
-
-    /* deal with the nodes which are reduced */
-    if (position_child > n)
-        skip_level = n - position_node - 1;
-    else
-        skip_level = position_child - position_node - 1;
-
-    /* compute probability of the node */
-    if (it != Node_Table.end()) // node has been recorded
+    if (top_k > 0 || !query_states.empty())
     {
-        Cudd_RecursiveDeref(manager, child);
-        return it->second * pow(2, skip_level);
+        std::cerr << "[error]--top_k and --query are not supported with mid-circuit measurement" << std::endl;
+        std::exit(1);
     }
-    else if (Cudd_IsConstant(child)) // constant
+    if (branches.empty())
     {
-        if (!(Cudd_IsComplement(child))) // constant 1
-        {
-            re = 0;
-            im = 0;
-            for (int i = 0; i < w; i++)
-            {
-                re -= cos(i/w * PI);
-                im -= sin(i/w * PI);
-            }
-            probability = pow(re, 2) + pow(im, 2);
-            Cudd_RecursiveDeref(manager, child);
-            return probability * pow(2, n - position_node - 1);
-        }
-        else // constant 0
-        {
-            Cudd_RecursiveDeref(manager, child);
-            return 0;
-        }
+        clbit_records[std::string(nClbits, '0')] = std::make_pair(sim_type == 0 ? shots : 1, 1.0);
+        branches.resize(1);
+        store_branch(branches[0]);
     }
-    else
+    merge_branches();
+
+    double oneroot2 = 1 / sqrt(2);
+    std::map<std::string, std::pair<int, double>>::iterator it;
+    for (int q : qubits)
     {
-        if (position_child >= n) // compute entry
+        std::vector<Branch> split;
+        for (int b = 0; b < branches.size(); b++)
         {
-            double int_value;
-            DdNode *tmp;
-            int oneEntry;
-            re = 0;
-            im = 0;
-            int *assign = new int[nVar];
-            for (int i = 0; i < nVar; i++)
-                assign[i] = 0;
-            /* TODO: BDD to truth table */
-            for (int i = 0; i < w; i++) //compute each complex value
+            load_branch(branches[b]);
+            double H_factor = pow(oneroot2, k%2);
+            double p[2];
+            std::vector<int> mode(n, SUM_FREE);
+            int root = tuple_root();
+            for (int v = 0; v < 2; v++)
             {
-                int_value = 0;
-                for (int j = 0; j < r; j++) //compute each integer
+                mode[q] = v;
+                tuple_sum_reset();
+                p[v] = tuple_sum(root, 0, mode, Cudd_ReadPerm(manager, q)) * H_factor * H_factor * rus_normalize_factor * rus_normalize_factor;
+            }
+            tuple_clear();
+
+            std::map<std::string, std::pair<int, double>> records[2];
+            for (it = clbit_records.begin(); it != clbit_records.end(); it++)
+            {
+                std::binomial_distribution<int> dis(it->second.first, p[1] / (p[0] + p[1]));
+                int nshots1 = dis(gen);
+                int nshots[2] = {it->second.first - nshots1, nshots1};
+                for (int v = 0; v < 2; v++)
                 {
-                    tmp = Cudd_Eval(manager, child, assign);
-                    Cudd_Ref(tmp);
-                    oneEntry = !(Cudd_IsComplement(tmp));
-                    Cudd_RecursiveDeref(manager, tmp);
-                    if (j == r - 1)
-                        int_value -= oneEntry * pow(2, j + shift - kd2);
-                    else
-                        int_value += oneEntry * pow(2, j + shift - kd2);
-                    full_adder_plus_1_start(nVar, assign, n + nAnci_fourInt);
+                    if (nshots[v] == 0 && !(isAll && p[v] > 0))
+                        continue;
+                    std::string record = it->first;
+                    for (int cIndex : measured_qubits_to_clbits[q])
+                        if (clbit_writer[cIndex] == q)
+                            record[nClbits - 1 - cIndex] = '0' + v;
+                    records[v][record].first += nshots[v];
+                    records[v][record].second += it->second.second * p[v] / (p[0] + p[1]);
                 }
-                /* translate to re and im */
-                re += int_value * cos((double) (w - i - 1)/w * PI);
-                im += int_value * sin((double) (w - i - 1)/w * PI);
-                full_adder_plus_1_start(nVar, assign, n);
-                for (int j = n + nAnci_fourInt; j < nVar; j++) // reset array: not necessary but straightforward
-                    assign[j] = 0;
             }
-            probability = pow(re, 2) + pow(im, 2);
-            delete[] assign;
-        }
-        else // trace edges
-        {
-            then_edge = measure_probability(child, kd2, nVar, nAnci_fourInt, 1);
-            else_edge = measure_probability(child, kd2, nVar, nAnci_fourInt, 0);
-            probability = then_edge + else_edge;
+
+            DdNode ***Bdd = All_Bdd;
+            double rus_saved = rus_normalize_factor;
+            measured_qubits_to_clbits[q].clear();
+            if (records[0].empty() && records[1].empty())
+                free_bdd(Bdd, r);
+            for (int v = 0; v < 2; v++)
+            {
+                if (records[v].empty())
+                    continue;
+                All_Bdd = (v == 0 && !records[1].empty()) ? copy_bdd() : Bdd;
+                std::unordered_map<int, int> qubit_to_state;
+                qubit_to_state[q] = v;
+                collapse_to(qubit_to_state, false);
+                rus_normalize_factor = rus_saved / sqrt(p[v]);
+                clbit_records = records[v];
+                split.push_back(Branch());
+                store_branch(split.back());
+            }
+            nodecount();
         }
+        branches.swap(split);
+        merge_branches();
     }
-
-    Node_Table[child] = probability;
-    Cudd_RecursiveDeref(manager, child);
-
-    return probability * pow(2, skip_level);
 }
 
 /**Function*************************************************************
 
-  Synopsis    [get total probability (used for expectation value calculation)]  // ===============================================================
+  Synopsis    [Merge the branches with equal states]
 
-  Description []
+  Description [The states of all branches are normalized, so two of them
+               are equal if their slices are the same BDD nodes with the
+               same k and shift; the records of the clbits are then
+               added up. The lines after a measurement whose qubit is
+               reset by rus are thus simulated once.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [split_branches]
 
 ***********************************************************************/
-double Simulator::get_total_prob(DdNode *node, int kd2, int nVar, int nAnci_fourInt)
+void Simulator::merge_branches()
 {
-    //int comple = Cudd_IsComplement(node);
-    //DdNode *tmp = Cudd_Regular(node);
-
-    double then_edge, else_edge, probability;
-    double re, im;
-    DdNode *child = node;//Cudd_NotCond(tmp, comple); // node itself
-    Cudd_Ref(child);
-    int position_node = Cudd_ReadPerm(manager, Cudd_NodeReadIndex(node)), position_child = Cudd_ReadPerm(manager, Cudd_NodeReadIndex(child));
-    int skip_level;
-    std::unordered_map<DdNode *, double>::iterator it;
-    it = Node_Table.find(child);
-
-    /* deal with the nodes which are reduced */
-    if (position_child > n)
-        skip_level = n - position_node - 1;
-    else
-        skip_level = position_child - position_node - 1;
-    skip_level = 0;
-
-    /* compute probability of the node */
-    if (it != Node_Table.end()) // node has been recorded
-    {
-        Cudd_RecursiveDeref(manager, child);
-        return it->second * pow(2, skip_level);
-    }
-    else if (Cudd_IsConstant(child)) // constant
-    {
-        if (!(Cudd_IsComplement(child))) // constant 1
-        {
-            re = 0;
-            im = 0;
-            for (int i = 0; i < w; i++)
-            {
-                re -= cos(i/w * PI);
-                im -= sin(i/w * PI);
-            }
-            probability = pow(re, 2) + pow(im, 2);
-            Cudd_RecursiveDeref(manager, child);
-            return probability * pow(2, n - position_node - 1);
-        }
-        else // constant 0
-        {
-            Cudd_RecursiveDeref(manager, child);
-            return 0;
-        }
-    }
-    else
+    std::vector<Branch> split;
+    split.swap(branches);
+    std::map<std::pair<std::vector<DdNode *>, std::vector<int>>, int> merged; // state -> branch
+    std::map<std::string, std::pair<int, double>>::iterator it;
+    for (int s = 0; s < split.size(); s++)
     {
-        if (position_child >= n) // compute entry
+        std::pair<std::vector<DdNode *>, std::vector<int>> key;
+        for (int i = 0; i < w; i++)
+            key.first.insert(key.first.end(), split[s].Bdd[i], split[s].Bdd[i] + split[s].r);
+        key.second = {split[s].r, split[s].k, split[s].shift};
+        std::map<std::pair<std::vector<DdNode *>, std::vector<int>>, int>::iterator found = merged.find(key);
+        if (found == merged.end())
         {
-            double int_value;
-            DdNode *tmp;
-            int oneEntry;
-            re = 0;
-            im = 0;
-            int *assign = new int[nVar];
-            for (int i = 0; i < nVar; i++)
-                assign[i] = 0;
-            /* TODO: BDD to truth table */
-            for (int i = 0; i < w; i++) //compute each complex value
-            {
-                int_value = 0;
-                for (int j = 0; j < r; j++) //compute each integer
-                {
-                    tmp = Cudd_Eval(manager, child, assign);
-                    Cudd_Ref(tmp);
-                    oneEntry = !(Cudd_IsComplement(tmp));
-                    Cudd_RecursiveDeref(manager, tmp);
-                    if (j == r - 1)
-                        int_value -= oneEntry * pow(2, j + shift - kd2);
-                    else
-                        int_value += oneEntry * pow(2, j + shift - kd2);
-                    full_adder_plus_1_start(nVar, assign, n + nAnci_fourInt);
-                }
-                /* translate to re and im */
-                re += int_value * cos((double) (w - i - 1)/w * PI);
-                im += int_value * sin((double) (w - i - 1)/w * PI);
-                full_adder_plus_1_start(nVar, assign, n);
-                for (int j = n + nAnci_fourInt; j < nVar; j++) // reset array: not necessary but straightforward
-                    assign[j] = 0;
-            }
-            probability = pow(re, 2) + pow(im, 2);
-            delete[] assign;
+            merged[key] = branches.size();
+            branches.push_back(split[s]);
+            continue;
         }
-        else // trace edges
+        Branch &branch = branches[found->second];
+        for (it = split[s].records.begin(); it != split[s].records.end(); it++)
         {
-            then_edge = measure_probability(child, kd2, nVar, nAnci_fourInt, 1);
-            else_edge = measure_probability(child, kd2, nVar, nAnci_fourInt, 0);
-            probability = then_edge + else_edge;
+            branch.records[it->first].first += it->second.first;
+            branch.records[it->first].second += it->second.second;
         }
+        free_bdd(split[s].Bdd, split[s].r);
     }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Make branch the state of the simulator]
 
-    Node_Table[child] = probability;
-    Cudd_RecursiveDeref(manager, child);
-    return probability * pow(2, skip_level);
+  Description [The slices are not copied; the branch keeps owning them.]
+
+  SideEffects []
+
+  SeeAlso     [store_branch]
+
+***********************************************************************/
+void Simulator::load_branch(const Branch &branch)
+{
+    All_Bdd = branch.Bdd;
+    r = branch.r;
+    k = branch.k;
+    shift = branch.shift;
+    rus_normalize_factor = branch.rus_normalize_factor;
+    measured_qubits_to_clbits = branch.measured_qubits_to_clbits;
+    clbit_records = branch.records;
 }
 
 /**Function*************************************************************
 
-  Synopsis    [measure one qubit]
+  Synopsis    [Save the state of the simulator to branch]
 
   Description []
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [load_branch]
 
 ***********************************************************************/
-void Simulator::measure_one(int position, int kd2, double H_factor, int nVar, int nAnci_fourInt, std::string *outcome)
+void Simulator::store_branch(Branch &branch)
 {
-    int index = Cudd_ReadInvPerm(manager, position);
-    int comple;
-    int noNode_f = 0; //flag: 1 if the node we want to measure is reduced
-    std::uniform_real_distribution<double> dis(0.0, 1.0);
-	  double p0, p1, p;
-    double rand_num;
-    double epsilon = 0.001;
-    DdNode *node, *tmp;
-    Cudd_Ref(bigBDD); // if this line is not added, there might be some error in CUDD.
+    branch.Bdd = All_Bdd;
+    branch.r = r;
+    branch.k = k;
+    branch.shift = shift;
+    branch.rus_normalize_factor = rus_normalize_factor;
+    branch.measured_qubits_to_clbits = measured_qubits_to_clbits;
+    branch.records = clbit_records;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [A referenced copy of the slices of the state]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [free_bdd]
 
-    /* traverse until the qubit measured */
-    comple = Cudd_IsComplement(bigBDD);
-    tmp = Cudd_Regular(bigBDD);
-    while (!(tmp->index == index))
+***********************************************************************/
+DdNode ***Simulator::copy_bdd()
+{
+    DdNode ***Bdd = new DdNode **[w];
+    for (int i = 0; i < w; i++)
     {
-        if (cuddIsConstant(tmp))
-        {
-            noNode_f = 1;
-            break;
-        }
-        if ((tmp->index < n) && (outcome->substr(n - 1 - tmp->index, 1) == "1"))
-        {
-            tmp = cuddT(tmp);
-        }
-        else
+        Bdd[i] = new DdNode *[r];
+        for (int j = 0; j < r; j++)
         {
-            comple ^= Cudd_IsComplement(cuddE(tmp));
-            tmp = Cudd_Regular(cuddE(tmp));
+            Bdd[i][j] = All_Bdd[i][j];
+            Cudd_Ref(Bdd[i][j]);
         }
     }
+    return Bdd;
+}
 
-    if (noNode_f)
-    {
-        p0 = 0.5;
-        p1 = 0.5;
-    }
-    else
-    {
-        node = (Cudd_NotCond(tmp, comple));
-        Cudd_Ref(node);
-        p0 = measure_probability(node, kd2, nVar, nAnci_fourInt, 0);
-        p0 *= H_factor * H_factor * normalize_factor * normalize_factor * rus_normalize_factor * rus_normalize_factor;
-        p1 = measure_probability(node, kd2, nVar, nAnci_fourInt, 1);
-        p1 *= H_factor * H_factor * normalize_factor * normalize_factor * rus_normalize_factor * rus_normalize_factor;
-        Cudd_RecursiveDeref(manager, node);
-        p = p0 + p1;
-        if (abs(p - 1) > epsilon)
-		{
-            std::cerr << "[error]Numerical error: p0 + p1 = " << p << ", not 1" << std::endl;
-			std::exit(1);
-		}
-    }
-
-    double error_tmp = abs(p0 + p1 - 1);
-    if (error_tmp > error)
-	    error = error_tmp;
+/**Function*************************************************************
 
-    /* sample */
-    rand_num = dis(gen);
-    if (rand_num > p0)
-    {
-        (*outcome)[n - 1 - index] = '1'; // LSB: q0
-        // (*outcome)[index] = '1'; // LSB: qn-1
-        normalize_factor /= sqrt(p1);
-    }
-    else
+  Synopsis    [Release w * nr slices]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [copy_bdd]
+
+***********************************************************************/
+void Simulator::free_bdd(DdNode ***Bdd, int nr)
+{
+    for (int i = 0; i < w; i++)
     {
-        // (*outcome)[n - 1 - index] = '0'; // LSB: q0
-        // (*outcome)[index] = '0'; // LSB: qn-1
-        normalize_factor /= sqrt(p0);
+        for (int j = 0; j < nr; j++)
+            Cudd_RecursiveDeref(manager, Bdd[i][j]);
+        delete[] Bdd[i];
     }
+    delete[] Bdd;
 }
 
 /**Function*************************************************************
 
-  Synopsis    [measurement]
+  Synopsis    [The node of the roots of all w * r slices]
 
-  Description []
+  Description [Slice (i, j) is entry i * r + j of a tuple, and equal
+               neighbours are kept as one run, so the sign extension and
+               the constants lower in the BDDs cost one entry each. Every
+               probability below is computed on such tuples: at each
+               qubit level all the slices are cofactored together, so the
+               amplitude of a basis state is read from the constants its
+               path reaches. Each distinct tuple becomes one node of
+               Tuple_Node, so it is cofactored, hashed and decoded once
+               per pass whatever reads it; the caller calls tuple_clear
+               when the pass is over.]
 
-  SideEffects []
+  SideEffects [Sets the tables of tuple_entry for the current state.]
 
-  SeeAlso     []
+  SeeAlso     [tuple_child tuple_prob tuple_sum]
 
 ***********************************************************************/
-void Simulator::getExpectVal()
+int Simulator::tuple_root()
 {
-// ================================================================================================================================
-if (1) {
-    DdNode* expval_map = Cudd_Not(Cudd_ReadOne(manager));
-    for (int i : expval_qubits)
+    leaf_pow2.resize(r);
+    for (int j = 0; j < r; j++)
+        leaf_pow2[j] = pow(2, j + shift - k/2);
+    leaf_re.resize(w);
+    leaf_im.resize(w);
+    for (int i = 0; i < w; i++)
     {
-        DdNode* tmp = Cudd_bddXor(manager, expval_map, Cudd_Not(Cudd_bddIthVar(manager, i)));
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, expval_map);
-        expval_map = tmp;
+        leaf_re[i] = cos((double) (w - i - 1)/w * PI);
+        leaf_im[i] = sin((double) (w - i - 1)/w * PI);
     }
-    for (int i = 0; i < w; i++) // F = All_Bdd[i][j]
-    {
+
+    tuple_scratch.clear();
+    for (int i = 0; i < w; i++)
         for (int j = 0; j < r; j++)
-        {
-            DdNode* tmp = Cudd_bddAnd(manager, All_Bdd[i][j], expval_map);
-            Cudd_Ref(tmp);
-            Cudd_RecursiveDeref(manager, All_Bdd[i][j]);
-            All_Bdd[i][j] = tmp;
-        }
-    }
+            if (!tuple_scratch.empty() && tuple_scratch.back().first == All_Bdd[i][j])
+                tuple_scratch.back().second++;
+            else
+                tuple_scratch.push_back(std::make_pair(All_Bdd[i][j], 1));
+    return tuple_id(tuple_scratch);
 }
-// ================================================================================================================================
 
-    double oneroot2 = 1 / sqrt(2);
-    double H_factor = pow(oneroot2, k%2);
-    int nAnci_oneInt = ceil(log(r) / log(2)), nAnci_fourInt = ceil(log(w) / log(2)), nAnci = nAnci_oneInt + nAnci_fourInt, nnAnci_fourInt = n + nAnci_fourInt, nVar = n + nAnci;
-    DdNode *tmp1, *tmp2, *tmp3;
+// hash of the runs of a tuple
+static size_t tuple_hash(const SliceRun *tuple, int length)
+{
+    size_t h = length;
+    for (int i = 0; i < length; i++)
+        h = (h * 1000003 ^ (size_t) tuple[i].first) * 31 + tuple[i].second;
+    return h;
+}
 
-    if (isReorder) Cudd_AutodynDisable(manager);
+/**Function*************************************************************
 
-    int *arrAnci_fourInt = new int[nAnci_fourInt];
-    for (int i = 0; i < nAnci_fourInt; i++)
-        arrAnci_fourInt[i] = 0;
-    int *arrAnci_oneInt = new int[nAnci_oneInt];
-    for (int i = 0; i < nAnci_oneInt; i++)
-        arrAnci_oneInt[i] = 0;
+  Synopsis    [The node of tuple, added if new]
 
-    bigBDD = Cudd_Not(Cudd_ReadOne(manager));
-    Cudd_Ref(bigBDD);
+  Description [Tuple_Slot is an open addressing table of node ids, probed
+               linearly; a slot stamped with an older epoch is empty, so
+               tuple_clear empties it without touching it. The runs of
+               all nodes are kept back to back in Tuple_Run. The position
+               of a node is the top level of its slices, n if they are
+               all constants.]
 
-    for (int i = 0; i < w; i++)
+  SideEffects []
+
+  SeeAlso     [tuple_root tuple_clear]
+
+***********************************************************************/
+int Simulator::tuple_id(const SliceTuple &tuple)
+{
+    if (2 * (Tuple_Node.size() + 1) > Tuple_Slot.size())
     {
-        tmp3 = Cudd_Not(Cudd_ReadOne(manager));
-        Cudd_Ref(tmp3);
-        for (int j = 0; j < r; j++)
+        // grow, then put the nodes of this epoch back
+        Tuple_Slot.assign(std::max((size_t) 1024, 2 * Tuple_Slot.size()), std::make_pair(0u, 0));
+        tuple_epoch = 1;
+        size_t mask = Tuple_Slot.size() - 1;
+        for (int id = 0; id < Tuple_Node.size(); id++)
         {
-            tmp1 = Cudd_ReadOne(manager);
-            Cudd_Ref(tmp1);
-            for (int h = n + nAnci - 1; h >= nnAnci_fourInt; h--)
-            {
-                if (arrAnci_oneInt[h - nnAnci_fourInt])
-                    tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, h), tmp1);
-                else
-                    tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, h)), tmp1);
-                Cudd_Ref(tmp2);
-                Cudd_RecursiveDeref(manager, tmp1);
-                tmp1 = tmp2;
-            }
-            tmp2 = Cudd_bddAnd(manager, All_Bdd[i][j], tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            // Cudd_RecursiveDeref(manager, All_Bdd[i][j]); // keep these BDDs for statevector after measurement
-            tmp1 = tmp2;
-            tmp2 = Cudd_bddOr(manager, tmp3, tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            Cudd_RecursiveDeref(manager, tmp3);
-            tmp3 = tmp2;
-            full_adder_plus_1(nAnci_oneInt, arrAnci_oneInt);
-        }
-        tmp1 = Cudd_ReadOne(manager);
-        Cudd_Ref(tmp1);
-        for (int j = nnAnci_fourInt - 1; j >= n; j--)
-        {
-            if (arrAnci_fourInt[j - n])
-                tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, j), tmp1);
-            else
-                tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, j)), tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            tmp1 = tmp2;
+            size_t h = tuple_hash(&Tuple_Run[Tuple_Node[id].start], Tuple_Node[id].length) & mask;
+            while (Tuple_Slot[h].first == tuple_epoch)
+                h = (h + 1) & mask;
+            Tuple_Slot[h] = std::make_pair(tuple_epoch, id);
         }
-        tmp2 = Cudd_bddAnd(manager, tmp3, tmp1);
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, tmp3);
-        tmp1 = tmp2;
-        tmp2 = Cudd_bddOr(manager, bigBDD, tmp1);
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, bigBDD);
-        bigBDD = tmp2;
-        full_adder_plus_1(nAnci_fourInt, arrAnci_fourInt);
-        for (int j = 0; j < nAnci_oneInt; j++) // reset array: not necessary but straightforward
-            arrAnci_oneInt[j] = 0;
     }
-    nodecount();
 
-// ================================================================================================================================
-if (1) {
-    expval = 2 * get_total_prob(bigBDD, k/2, nVar, nAnci_fourInt) * H_factor * H_factor - 1;
-    return;
-}
-// ================================================================================================================================
+    size_t mask = Tuple_Slot.size() - 1;
+    size_t h = tuple_hash(tuple.data(), tuple.size()) & mask;
+    for (; Tuple_Slot[h].first == tuple_epoch; h = (h + 1) & mask)
+    {
+        TupleNode &node = Tuple_Node[Tuple_Slot[h].second];
+        if (node.length == tuple.size() && std::equal(tuple.begin(), tuple.end(), Tuple_Run.begin() + node.start))
+            return Tuple_Slot[h].second;
+    }
+
+    TupleNode node;
+    node.start = Tuple_Run.size();
+    node.length = tuple.size();
+    node.position = n;
+    for (int h = 0; h < tuple.size(); h++)
+        if (!Cudd_IsConstant(tuple[h].first))
+            node.position = std::min(node.position, Cudd_ReadPerm(manager, Cudd_NodeReadIndex(tuple[h].first)));
+    node.child[0] = node.child[1] = -1;
+    node.prob = node.best = -1;
+    Tuple_Run.insert(Tuple_Run.end(), tuple.begin(), tuple.end());
+    Tuple_Slot[h] = std::make_pair(tuple_epoch, (int) Tuple_Node.size());
+    Tuple_Node.push_back(node);
+    return Tuple_Node.size() - 1;
 }
 
 /**Function*************************************************************
 
-  Synopsis    [measurement]
+  Synopsis    [Drop all tuple nodes, at the end of a pass]
 
-  Description []
+  Description [The tables keep their memory for the next pass.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [tuple_id tuple_sum_reset]
 
 ***********************************************************************/
-void Simulator::measurement()
+void Simulator::tuple_clear()
 {
-    double oneroot2 = 1 / sqrt(2);
-    double H_factor = pow(oneroot2, k%2);
-    int nAnci_oneInt = ceil(log(r) / log(2)), nAnci_fourInt = ceil(log(w) / log(2)), nAnci = nAnci_oneInt + nAnci_fourInt, nnAnci_fourInt = n + nAnci_fourInt, nVar = n + nAnci;
-    DdNode *tmp1, *tmp2, *tmp3;
+    Tuple_Node.clear();
+    Tuple_Run.clear();
+    if (++tuple_epoch == 0)
+    {
+        Tuple_Slot.assign(Tuple_Slot.size(), std::make_pair(0u, 0));
+        tuple_epoch = 1;
+    }
+}
 
-    if (isReorder) Cudd_AutodynDisable(manager);
+/**Function*************************************************************
 
-    int *arrAnci_fourInt = new int[nAnci_fourInt];
-    for (int i = 0; i < nAnci_fourInt; i++)
-        arrAnci_fourInt[i] = 0;
-    int *arrAnci_oneInt = new int[nAnci_oneInt];
-    for (int i = 0; i < nAnci_oneInt; i++)
-        arrAnci_oneInt[i] = 0;
+  Synopsis    [Start the memo of tuple_sum for a new mode]
 
-    bigBDD = Cudd_Not(Cudd_ReadOne(manager));
-    Cudd_Ref(bigBDD);
+  Description [Sum_Memo is indexed by node id; an entry stamped with an
+               older epoch is unknown.]
 
-    for (int i = 0; i < w; i++)
-    {
-        tmp3 = Cudd_Not(Cudd_ReadOne(manager));
-        Cudd_Ref(tmp3);
-        for (int j = 0; j < r; j++)
-        {
-            tmp1 = Cudd_ReadOne(manager);
-            Cudd_Ref(tmp1);
-            for (int h = n + nAnci - 1; h >= nnAnci_fourInt; h--)
-            {
-                if (arrAnci_oneInt[h - nnAnci_fourInt])
-                    tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, h), tmp1);
-                else
-                    tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, h)), tmp1);
-                Cudd_Ref(tmp2);
-                Cudd_RecursiveDeref(manager, tmp1);
-                tmp1 = tmp2;
-            }
-            tmp2 = Cudd_bddAnd(manager, All_Bdd[i][j], tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            // Cudd_RecursiveDeref(manager, All_Bdd[i][j]); // keep these BDDs for statevector after measurement
-            tmp1 = tmp2;
-            tmp2 = Cudd_bddOr(manager, tmp3, tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            Cudd_RecursiveDeref(manager, tmp3);
-            tmp3 = tmp2;
-            full_adder_plus_1(nAnci_oneInt, arrAnci_oneInt);
-        }
-        tmp1 = Cudd_ReadOne(manager);
-        Cudd_Ref(tmp1);
-        for (int j = nnAnci_fourInt - 1; j >= n; j--)
-        {
-            if (arrAnci_fourInt[j - n])
-                tmp2 = Cudd_bddAnd(manager, Cudd_bddIthVar(manager, j), tmp1);
-            else
-                tmp2 = Cudd_bddAnd(manager, Cudd_Not(Cudd_bddIthVar(manager, j)), tmp1);
-            Cudd_Ref(tmp2);
-            Cudd_RecursiveDeref(manager, tmp1);
-            tmp1 = tmp2;
-        }
-        tmp2 = Cudd_bddAnd(manager, tmp3, tmp1);
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, tmp3);
-        tmp1 = tmp2;
-        tmp2 = Cudd_bddOr(manager, bigBDD, tmp1);
-        Cudd_Ref(tmp2);
-        Cudd_RecursiveDeref(manager, tmp1);
-        Cudd_RecursiveDeref(manager, bigBDD);
-        bigBDD = tmp2;
-        full_adder_plus_1(nAnci_fourInt, arrAnci_fourInt);
-        for (int j = 0; j < nAnci_oneInt; j++) // reset array: not necessary but straightforward
-            arrAnci_oneInt[j] = 0;
-    }
-    nodecount();
+  SideEffects []
 
-    // move measured qubits to the top
-    int *permutation = new int[nVar];
-    int indCount1 = 0;
-    int indCount0 = 0;  // number of measured qubits
-    for (int i = 0; i < n; i++){
-        if (!measured_qubits_to_clbits[i].empty())
-        {
-            indCount0++;
-        }
-    }
-    for (int i = 0; i < n; i++)
+  SeeAlso     [tuple_sum tuple_clear]
+
+***********************************************************************/
+void Simulator::tuple_sum_reset()
+{
+    if (++sum_epoch == 0)
     {
-        int index = Cudd_ReadInvPerm(manager, i);
-        if (!measured_qubits_to_clbits[index].empty())
-        {
-            permutation[indCount1] = index;
-            indCount1++;
-        }
-        else
-        {
-            permutation[indCount0] = index;
-            indCount0++;
-        }
+        Sum_Memo.assign(Sum_Memo.size(), std::make_pair(0u, 0.0));
+        sum_epoch = 1;
     }
-    for (int i = n; i < nVar; i++)
-        permutation[i] = Cudd_ReadInvPerm(manager, i);
-    int dum = Cudd_ShuffleHeap(manager, permutation);
-    nodecount();
+}
 
-    std::unordered_map<std::string, int>::iterator it;
-    std::string measure_outcome_qubits;
-    std::string measure_outcome_clbits;
-    for (int i = 0; i < shots; i++)
-    {
-        for (int j = 0; j < n; j++)
-        {
-            measure_outcome_qubits += '0';
-        }
-        for (int j = 0; j < nClbits; j++)
-        {
-            measure_outcome_clbits += '0';
-        }
-        normalize_factor = 1;
+/**Function*************************************************************
 
-        for (int j = 0; j < indCount1; j++) // measure for the (top) j^th level variable
-        {
-            measure_one(j, k/2, H_factor, nVar, nAnci_fourInt, &measure_outcome_qubits);
-        }
+  Synopsis    [Cofactor every slice of tuple by variable index = value]
 
-        // convert measurement outcome of qubits to clbits
-        for (int qIndex = 0; qIndex < n; qIndex++)
-        {
-            for (int cIndex : measured_qubits_to_clbits[qIndex])
-            {
-                measure_outcome_clbits[nClbits - 1 - cIndex] = measure_outcome_qubits[n - 1 - qIndex];
-                // the order is reversed
-            }
-        }
-        it = state_count.find(measure_outcome_clbits);
-        if (it != state_count.end())
-            state_count[measure_outcome_clbits] = it->second + 1;
+  Description [Runs whose children coincide are merged again.]
+
+  SideEffects []
+
+  SeeAlso     [tuple_child]
+
+***********************************************************************/
+void Simulator::tuple_cofactor(const SliceRun *tuple, int length, int index, int value, SliceTuple &child)
+{
+    child.clear();
+    for (int h = 0; h < length; h++)
+    {
+        DdNode *node = (Cudd_NodeReadIndex(tuple[h].first) == index) ? Cudd_Child(manager, tuple[h].first, value) : tuple[h].first;
+        if (!child.empty() && child.back().first == node)
+            child.back().second += tuple[h].second;
         else
-            state_count[measure_outcome_clbits] = 1;
-        measure_outcome = measure_outcome_qubits;
-        measure_outcome_qubits.clear();
-        measure_outcome_clbits.clear();
+            child.push_back(std::make_pair(node, tuple[h].second));
     }
-
-    Cudd_RecursiveDeref(manager, bigBDD);
-    delete[] arrAnci_fourInt;
-    delete[] arrAnci_oneInt;
-    delete[] permutation;
 }
 
 /**Function*************************************************************
 
-  Synopsis    [get statevector string based on BDDs]
+  Synopsis    [The node of tuple id with the qubit at level position set
+               to value]
 
-  Description []
+  Description [id itself if no slice depends on that qubit.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [tuple_cofactor]
 
 ***********************************************************************/
-void Simulator::getStatevector()
+int Simulator::tuple_child(int id, int position, int value)
 {
-    mpf_t one_over_sqrt_2;
-    mpf_init(one_over_sqrt_2);
-    mpf_sqrt_ui(one_over_sqrt_2, 2);
-    mpf_div_ui(one_over_sqrt_2, one_over_sqrt_2, 2);
-    // sqrt_val = 1/sqrt(2)
-
-    mpz_t int_value;
-    mpz_init(int_value);
-    mpf_t int_value_as_float;
-    mpf_init(int_value_as_float);
-
-    mpf_t re, im;
-    mpf_init(re);
-    mpf_init(im);
-
-    mpf_t cos_val;
-    mpf_init(cos_val);
-    mpf_t sin_val;
-    mpf_init(sin_val);
-
-    mpz_t tmp_int;
-    mpz_init(tmp_int);
-    mpf_t tmp_float;
-    mpf_init(tmp_float);
-
-    std::string bitstring;
-
-    mpz_t two;
-    mpz_init(two);
-    mpz_set_str(two, "2", 10);
-    mpf_t H_factor;
-    mpf_init(H_factor);
-    mpz_pow_ui(tmp_int, two, k / 2);
-    mpf_set_z(H_factor, tmp_int);
-    if (k % 2 == 1)
-        mpf_div(H_factor, H_factor, one_over_sqrt_2);
-
-    long double final_re = 0;
-    long double final_im = 0;
-
-    int *assign = new int[n];
-    unsigned long long nEntries = pow(2, n);      // should timeout before overflow occurs in "nEntries"
-    int oneEntry;
-    DdNode *tmp;
-
-    for (int i = 0; i < n; i++)                   //initialize assignment
-        assign[i] = 0;
+    if (Tuple_Node[id].position != position)
+        return id;
+    if (Tuple_Node[id].child[value] < 0)
+    {
+        tuple_cofactor(&Tuple_Run[Tuple_Node[id].start], Tuple_Node[id].length, Cudd_ReadInvPerm(manager, position), value, tuple_scratch);
+        int child_id = tuple_id(tuple_scratch);
+        Tuple_Node[id].child[value] = child_id; // tuple_id may move Tuple_Node
+    }
+    return Tuple_Node[id].child[value];
+}
 
-    statevector = "[";
+/**Function*************************************************************
+
+  Synopsis    [Amplitude of a tuple of constants, before the 1/sqrt(2) of
+               an odd k and the normalization factors]
+
+  Description [The constants are the bits of the w integers, sign bit
+               last; the amplitude is sum_i int_i * omega^(w-1-i) scaled
+               by 2^(shift - k/2). The run holding the sign bit of an
+               integer is cut off first (-2^m instead of -2^(r-1) + ...
+               + 2^m), so the sum stays exact in a double whatever r is;
+               below it only the runs of ones are read. omega^e and
+               omega^(w-e) have opposite cosines and equal sines, so
+               their integers are combined before the multiplication and
+               a part of the amplitude that cancels comes out exactly 0.
+               Powers of two and omega come from the tables of
+               tuple_root.]
 
-    for (unsigned long long i = 0; i < nEntries; i++) // compute every entry
+  SideEffects []
+
+  SeeAlso     [tuple_entry tuple_amplitude_gmp]
+
+***********************************************************************/
+std::complex<double> Simulator::tuple_amplitude(const SliceRun *tuple)
+{
+    std::vector<double> int_value(w, 0);
+    int h = 0, start = 0; // run h covers [start, start + length)
+    for (int i = 0; i < w; i++) //compute each integer
     {
-        final_re = 0;
-        final_im = 0;
-        mpf_init(re);
-        mpf_init(im);
-        bool isZero = 0;
-        for (int j = 0; j < n; j++)
+        int low = i * r, high = low + r; // bits of integer i
+        while (start + tuple[h].second < high)
         {
-            if (!measured_qubits_to_clbits[j].empty())
-                if (assign[j] != stoi(measure_outcome.substr(n - 1 - j, 1)))
-                {
-                    isZero = 1;
-                    break;
-                }
+            if (!Cudd_IsComplement(tuple[h].first))
+                for (int p = std::max(start, low); p < start + tuple[h].second; p++)
+                    int_value[i] += leaf_pow2[p - low];
+            start += tuple[h].second;
+            h++;
         }
+        // run h holds the sign bit, from bit m = max(start, low) - low up
+        if (!Cudd_IsComplement(tuple[h].first))
+            int_value[i] -= leaf_pow2[std::max(start, low) - low];
+    }
 
-        if (isZero == 0)
-        {
-            for (int j = 0; j < w; j++) // compute every complex value
-            {
-                bitstring = "";
+    /* translate to re and im, integer i = w-1-e is the coefficient of omega^e */
+    double re = int_value[w - 1], im = int_value[w/2 - 1];
+    for (int e = 1; e < w/2; e++)
+    {
+        re += (int_value[w - 1 - e] - int_value[e - 1]) * leaf_re[w - 1 - e];
+        im += (int_value[w - 1 - e] + int_value[e - 1]) * leaf_im[w - 1 - e];
+    }
+    return std::complex<double>(re, im);
+}
 
-                mpz_init(int_value);
-                for (int h = 0; h < r; h++) // compute every integer
-                {
-                    tmp = Cudd_Eval(manager, All_Bdd[j][h], assign);
-                    Cudd_Ref(tmp);
-                    oneEntry = !(Cudd_IsComplement(tmp));
-                    Cudd_RecursiveDeref(manager, tmp);
-                    if (Cudd_IsComplement(tmp))
-                    {
-                        bitstring += "0";
-                    }
-                    else
-                    {
-                        bitstring += "1";
-                    }
+/**Function*************************************************************
 
-                }
-                std::reverse(bitstring.begin(), bitstring.end());
-                bool isNeg = (bitstring[0]=='1');
-                if (isNeg)
-                {
-                    std::string inv_str = "1";
-                    for (int digitIndex = 0; digitIndex < r; digitIndex++)
-                    {
-                        inv_str += "0";
-                    }
-                    mpz_t raw_data;
-                    mpz_init_set_str(raw_data, bitstring.c_str(), 2);
-                    mpz_t inverter;
-                    mpz_init_set_str(inverter, inv_str.c_str(), 2);
-
-                    mpz_sub(int_value, raw_data, inverter);
-                }
-                else
-                {
-                    mpz_set_str(int_value, bitstring.c_str(), 2);
-                }
+  Synopsis    [tuple_amplitude in GMP arithmetic]
 
-                switch (j)
-                {
-                case 3:
-                    mpf_set_d(cos_val, 1);
-                    mpf_set_d(sin_val, 0);
-                    break;
-                case 2:
-                    mpf_set(cos_val, one_over_sqrt_2);
-                    mpf_set(sin_val, one_over_sqrt_2);
-                    break;
-                case 1:
-                    mpf_set_d(cos_val, 0);
-                    mpf_set_d(sin_val, 1);
-                    break;
-                case 0:
-                    mpf_neg(cos_val, one_over_sqrt_2); // -sqrt(2)/2
-                    mpf_set(sin_val, one_over_sqrt_2);
-                    break;
-                default:
-                    std::cerr << "Warning: Unknown index (" << j << ")\n";
-                    break;
-                }
+  Description [For r above 53 bits, where an integer no longer fits a
+               double. The integers are combined exactly; the
+               coefficients come from leaf_re_gmp and leaf_im_gmp.]
+
+  SideEffects []
+
+  SeeAlso     [tuple_amplitude]
+
+***********************************************************************/
+std::complex<double> Simulator::tuple_amplitude_gmp(const SliceRun *tuple)
+{
+    std::vector<mpz_class> int_value(w);
+    int h = 0, start = 0; // run h covers [start, start + length)
+    for (int i = 0; i < w; i++)
+    {
+        int low = i * r, high = low + r;
+        while (start + tuple[h].second < high)
+        {
+            if (!Cudd_IsComplement(tuple[h].first))
+                for (int p = std::max(start, low); p < start + tuple[h].second; p++)
+                    mpz_setbit(int_value[i].get_mpz_t(), p - low);
+            start += tuple[h].second;
+            h++;
+        }
+        if (!Cudd_IsComplement(tuple[h].first))
+        {
+            mpz_class sign_run;
+            mpz_setbit(sign_run.get_mpz_t(), std::max(start, low) - low);
+            int_value[i] -= sign_run;
+        }
+    }
+
+    mpf_class re(int_value[w - 1], r + 64), im(int_value[w/2 - 1], r + 64), tmp(0, r + 64);
+    for (int e = 1; e < w/2; e++)
+    {
+        tmp = int_value[w - 1 - e] - int_value[e - 1];
+        re += tmp * leaf_re_gmp[w - 1 - e];
+        tmp = int_value[w - 1 - e] + int_value[e - 1];
+        im += tmp * leaf_im_gmp[w - 1 - e];
+    }
+    int exp2 = shift - k/2;
+    if (exp2 >= 0)
+    {
+        mpf_mul_2exp(re.get_mpf_t(), re.get_mpf_t(), exp2);
+        mpf_mul_2exp(im.get_mpf_t(), im.get_mpf_t(), exp2);
+    }
+    else
+    {
+        mpf_div_2exp(re.get_mpf_t(), re.get_mpf_t(), -exp2);
+        mpf_div_2exp(im.get_mpf_t(), im.get_mpf_t(), -exp2);
+    }
+    return std::complex<double>(re.get_d(), im.get_d());
+}
+
+/**Function*************************************************************
+
+  Synopsis    [|amplitude|^2 of a tuple of constants]
+
+  Description []
 
-                mpf_set_z(int_value_as_float, int_value);
+  SideEffects []
+
+  SeeAlso     [tuple_prob tuple_amplitude]
 
-                mpf_mul(tmp_float, int_value_as_float, cos_val);
-                mpf_add(re, re, tmp_float);
-                mpf_mul(tmp_float, int_value_as_float, sin_val);
-                mpf_add(im, im, tmp_float);
-                // translate to re and im
+***********************************************************************/
+double Simulator::tuple_entry(const SliceRun *tuple)
+{
+    return std::norm(tuple_amplitude(tuple));
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Sum of |amplitude|^2 over the qubits from the level of
+               tuple node id down]
+
+  Description [Kept in the node.]
+
+  SideEffects []
+
+  SeeAlso     [tuple_sum]
+
+***********************************************************************/
+double Simulator::tuple_prob(int id)
+{
+    if (Tuple_Node[id].prob >= 0)
+        return Tuple_Node[id].prob;
+
+    int position = Tuple_Node[id].position;
+    double prob;
+    if (position == n)
+        prob = tuple_entry(&Tuple_Run[Tuple_Node[id].start]);
+    else
+    {
+        int child0 = tuple_child(id, position, 0), child1 = tuple_child(id, position, 1);
+        prob = tuple_prob(child0) * pow(2, Tuple_Node[child0].position - position - 1)
+             + tuple_prob(child1) * pow(2, Tuple_Node[child1].position - position - 1);
+    }
+    Tuple_Node[id].prob = prob;
+    return prob;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Sum of |amplitude|^2 over the qubits from level position
+               down, weighted by mode]
+
+  Description [Tuple node id must not sit above level position. mode[q]
+               is SUM_FREE (both values count), 0 or 1 (only that value
+               counts) or SUM_SIGN (the value 1 counts negatively);
+               levels below last are always SUM_FREE and mode is not read
+               there. A level no slice depends on counts twice, once or
+               cancels to 0 accordingly. Below last this is tuple_prob,
+               which every mode shares; above it the sums of this mode
+               are kept in Sum_Memo, started by tuple_sum_reset.]
+
+  SideEffects []
+
+  SeeAlso     [tuple_root tuple_prob]
+
+***********************************************************************/
+double Simulator::tuple_sum(int id, int position, const std::vector<int> &mode, int last)
+{
+    int top = Tuple_Node[id].position;
+    double scale = 1;
+    for (int l = position; l < top; l++)
+    {
+        int m = (l > last) ? SUM_FREE : mode[Cudd_ReadInvPerm(manager, l)];
+        if (m == SUM_SIGN)
+            return 0;
+        if (m == SUM_FREE)
+            scale *= 2;
+    }
+    if (top > last)
+        return scale * tuple_prob(id);
+
+    if (Sum_Memo.size() <= id)
+        Sum_Memo.resize(Tuple_Node.size(), std::make_pair(0u, 0.0));
+    if (Sum_Memo[id].first == sum_epoch)
+        return scale * Sum_Memo[id].second;
+
+    int m = mode[Cudd_ReadInvPerm(manager, top)];
+    double sum = 0;
+    if (m != 1)
+        sum += tuple_sum(tuple_child(id, top, 0), top + 1, mode, last);
+    if (m != 0)
+    {
+        double then_sum = tuple_sum(tuple_child(id, top, 1), top + 1, mode, last);
+        sum += (m == SUM_SIGN) ? -then_sum : then_sum;
+    }
+    Sum_Memo[id] = std::make_pair(sum_epoch, sum);
+    return scale * sum;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [The clbits of an outcome of the measured qubits]
+
+  Description [The clbits measured mid-circuit are taken from
+               clbit_record, and the order is reversed: q0 and c0 last.
+               A clbit measured more than once keeps the last measure in
+               program order, see clbit_writer.]
+
+  SideEffects []
+
+  SeeAlso     [sample_counts marginal_probs top_outcomes]
+
+***********************************************************************/
+std::string Simulator::outcome_clbits(const std::string &outcome)
+{
+    std::string clbits = clbit_record.empty() ? std::string(nClbits, '0') : clbit_record;
+    for (int qIndex = 0; qIndex < n; qIndex++)
+        for (int cIndex : measured_qubits_to_clbits[qIndex])
+            if (clbit_writer[cIndex] == qIndex)
+                clbits[nClbits - 1 - cIndex] = outcome[n - 1 - qIndex];
+    return clbits;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Move frontier from level position to the next level]
+
+  Description [value is the value of the qubit at position, or -1 to sum
+               over both. A node of the frontier stands for the basis
+               states below it, times its weight: a node at position is
+               replaced by its cofactors, whose weights count the levels
+               they skip, and a node below position keeps its weight, or
+               half of it if the value is fixed. Equal nodes are merged,
+               so the frontier is at most the width of the tuple graph.
+               Returns the probability of next, without the factor.]
+
+  SideEffects []
+
+  SeeAlso     [frontier_sum sample_counts]
+
+***********************************************************************/
+double Simulator::frontier_step(const Frontier &frontier, int position, int value, Frontier &next)
+{
+    next.clear();
+    for (int f = 0; f < frontier.size(); f++)
+    {
+        int id = frontier[f].first;
+        double weight = frontier[f].second;
+        if (Tuple_Node[id].position != position)
+        {
+            next.push_back(std::make_pair(id, value < 0 ? weight : weight / 2));
+            continue;
+        }
+        for (int v = 0; v < 2; v++)
+            if (value < 0 || v == value)
+            {
+                int child = tuple_child(id, position, v);
+                next.push_back(std::make_pair(child, weight * pow(2, Tuple_Node[child].position - position - 1)));
             }
-            
-            mpf_div(tmp_float, re, H_factor);            
-            final_re = mpf_get_d(tmp_float) * normalize_factor * rus_normalize_factor;
-            mpf_div(tmp_float, im, H_factor);
-            final_im = mpf_get_d(tmp_float) * normalize_factor * rus_normalize_factor;
+    }
+
+    std::sort(next.begin(), next.end());
+    int m = 0;
+    double prob = 0;
+    for (int f = 0; f < next.size(); f++)
+    {
+        if (m > 0 && next[m - 1].first == next[f].first)
+            next[m - 1].second += next[f].second;
+        else if (tuple_prob(next[f].first) > 0)
+            next[m++] = next[f];
+        else
+            continue;
+        prob += next[f].second * tuple_prob(next[f].first);
+    }
+    next.resize(m);
+    return prob;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Sum frontier over the unmeasured levels from position]
+
+  Description [Stops at the next measured level, or after last, the
+               lowest one; returns that level.]
+
+  SideEffects []
+
+  SeeAlso     [frontier_step]
+
+***********************************************************************/
+int Simulator::frontier_sum(Frontier &frontier, int position, int last)
+{
+    Frontier next;
+    while (position <= last && measured_above[position + 1] == measured_above[position])
+    {
+        bool isSplit = false;
+        for (int f = 0; f < frontier.size(); f++)
+            isSplit |= (Tuple_Node[frontier[f].first].position == position);
+        if (isSplit)
+        {
+            frontier_step(frontier, position, -1, next);
+            frontier.swap(next);
+        }
+        position++;
+    }
+    return position;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Split nshots between the outcomes of the measured qubits
+               below frontier]
+
+  Description [The measured qubits may sit on any levels, the lowest
+               being last, and p_node is the probability of the outcomes
+               fixed above position. The unmeasured levels are summed
+               into the frontier on the way down, and at a measured
+               level the shots are split between its two values with one
+               binomial draw; each nonempty part goes down its own
+               frontier. So the cost grows with the number of distinct
+               outcomes, not with shots times qubits, and the variable
+               order is never changed. The probabilities are those of
+               the tuple nodes, shared by all branches.]
+
+  SideEffects [Adds to state_count; measure_outcome and normalize_factor
+               are left at the last outcome reached.]
+
+  SeeAlso     [measurement frontier_step]
+
+***********************************************************************/
+void Simulator::sample_counts(const Frontier &frontier, int position, int nshots, double p_node, int last, double factor, std::string &outcome)
+{
+    Frontier sum = frontier, child[2];
+    position = frontier_sum(sum, position, last);
+    if (position > last)
+    {
+        state_count[outcome_clbits(outcome)] += nshots;
+        measure_outcome = outcome;
+        normalize_factor = 1 / sqrt(p_node);
+        return;
+    }
+
+    int index = Cudd_ReadInvPerm(manager, position);
+    double epsilon = 0.001;
+    double p0 = frontier_step(sum, position, 0, child[0]) * factor;
+    double p1 = frontier_step(sum, position, 1, child[1]) * factor;
+
+    double error_tmp = abs((p0 + p1) / p_node - 1);
+    if (error_tmp > epsilon)
+    {
+        std::cerr << "[error]Numerical error: p0 + p1 = " << (p0 + p1) / p_node << ", not 1" << std::endl;
+        std::exit(1);
+    }
+    if (error_tmp > error)
+        error = error_tmp;
+
+    std::binomial_distribution<int> dis(nshots, p1 / (p0 + p1));
+    int nshots1 = dis(gen);
+    if (nshots - nshots1 > 0)
+        sample_counts(child[0], position + 1, nshots - nshots1, p0, last, factor, outcome);
+    if (nshots1 > 0)
+    {
+        outcome[n - 1 - index] = '1'; // LSB: q0
+        sample_counts(child[1], position + 1, nshots1, p1, last, factor, outcome);
+        outcome[n - 1 - index] = '0';
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Add the exact probabilities of the outcomes below frontier
+               to marginal_prob]
+
+  Description [The same descent as sample_counts, but both values are
+               always followed (unless their probability is 0), so the
+               cost grows with the BDDs times the number of outcomes and
+               nothing is drawn at random. marginal_prob is indexed by
+               the classical bits, bit c for c[c].]
+
+  SideEffects []
+
+  SeeAlso     [sample_counts measurement]
+
+***********************************************************************/
+void Simulator::marginal_probs(const Frontier &frontier, int position, double p_node, int last, double factor, std::string &outcome)
+{
+    Frontier sum = frontier, child[2];
+    position = frontier_sum(sum, position, last);
+    if (position > last)
+    {
+        std::string clbits = outcome_clbits(outcome);
+        unsigned long long index = 0;
+        for (int cIndex = 0; cIndex < nClbits; cIndex++)
+            if (clbits[nClbits - 1 - cIndex] == '1')
+                index |= 1ULL << cIndex;
+        marginal_prob[index] += p_node;
+        return;
+    }
+
+    int index = Cudd_ReadInvPerm(manager, position);
+    double p0 = frontier_step(sum, position, 0, child[0]) * factor;
+    double p1 = frontier_step(sum, position, 1, child[1]) * factor;
+
+    double error_tmp = abs((p0 + p1) / p_node - 1);
+    if (error_tmp > error)
+        error = error_tmp;
+
+    if (p0 > 0)
+        marginal_probs(child[0], position + 1, p0, last, factor, outcome);
+    if (p1 > 0)
+    {
+        outcome[n - 1 - index] = '1'; // LSB: q0
+        marginal_probs(child[1], position + 1, p1, last, factor, outcome);
+        outcome[n - 1 - index] = '0';
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Largest probability of an outcome of the measured qubits
+               below tuple node id]
+
+  Description [The outcome is chosen on the measured levels and summed
+               over the others, so a skipped level counts once if it is
+               measured and twice if not. Below an unmeasured level the
+               best outcomes of the two cofactors are added, which may
+               exceed the best outcome itself but never falls below it.
+               Kept in the node, as the measured levels are fixed for a
+               pass.]
+
+  SideEffects []
+
+  SeeAlso     [top_outcomes tuple_prob]
+
+***********************************************************************/
+double Simulator::tuple_best(int id)
+{
+    int position = Tuple_Node[id].position;
+    if (position == n || measured_above[position] == measured_above[n])
+        return tuple_prob(id);
+    if (Tuple_Node[id].best >= 0)
+        return Tuple_Node[id].best;
+
+    bool isMeasured = measured_above[position + 1] > measured_above[position];
+    double best = 0;
+    for (int value = 0; value < 2; value++)
+    {
+        int child = tuple_child(id, position, value);
+        int free = Tuple_Node[child].position - position - 1 - (measured_above[Tuple_Node[child].position] - measured_above[position + 1]);
+        double child_best = tuple_best(child) * pow(2, free);
+        best = isMeasured ? std::max(best, child_best) : best + child_best;
+    }
+    Tuple_Node[id].best = best;
+    return best;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Bound on the probability of an outcome below frontier]
+
+  Description [The sum of tuple_best over the nodes; a measured level a
+               node skips picks one value, so it does not count in the
+               weight.]
+
+  SideEffects []
+
+  SeeAlso     [top_outcomes]
+
+***********************************************************************/
+double Simulator::frontier_bound(const Frontier &frontier, int position)
+{
+    double bound = 0;
+    for (int f = 0; f < frontier.size(); f++)
+    {
+        int id = frontier[f].first;
+        bound += frontier[f].second * tuple_best(id) / pow(2, measured_above[Tuple_Node[id].position] - measured_above[position]);
+    }
+    return bound;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [The top_k most probable outcomes of the measured qubits]
+
+  Description [Best-first search over the measured levels, the lowest
+               being last. A partial outcome is a frontier, ranked by
+               the bound on the best outcome below it (frontier_bound);
+               the probability mass below it would be a valid bound as
+               well, but a loose one that makes a flat distribution
+               expand every partial outcome. A complete outcome ranks by
+               its exact probability, so they come out of the queue
+               most probable first. Ties go to the deeper one.]
+
+  SideEffects [Sets top_result.]
+
+  SeeAlso     [sample_counts tuple_best]
+
+***********************************************************************/
+void Simulator::top_outcomes(int root, int last, double factor)
+{
+    typedef std::pair<std::pair<double, int>, std::pair<Frontier, std::string>> Partial; // ((bound, position), (frontier, outcome))
+    std::priority_queue<Partial> queue;
+    Frontier frontier(1, std::make_pair(root, pow(2, Tuple_Node[root].position)));
+    int position = frontier_sum(frontier, 0, last);
+    queue.push(std::make_pair(std::make_pair(frontier_bound(frontier, position) * factor, position), std::make_pair(frontier, std::string(n, '0'))));
+
+    top_result.clear();
+    while (!queue.empty() && top_result.size() < top_k)
+    {
+        Partial partial = queue.top();
+        queue.pop();
+        position = partial.first.second;
+        std::string &outcome = partial.second.second;
+        if (position > last)
+        {
+            top_result.push_back(std::make_pair(outcome_clbits(outcome), partial.first.first));
+            continue;
+        }
+
+        int index = Cudd_ReadInvPerm(manager, position);
+        for (int value = 0; value < 2; value++)
+        {
+            Frontier child;
+            frontier_step(partial.second.first, position, value, child);
+            int next = frontier_sum(child, position + 1, last);
+            double bound = frontier_bound(child, next) * factor;
+            if (bound == 0)
+                continue;
+            outcome[n - 1 - index] = '0' + value; // LSB: q0
+            queue.push(std::make_pair(std::make_pair(bound, next), std::make_pair(child, outcome)));
         }
+    }
+}
 
-        if ((final_re == 0)&&(final_im == 0))
-            statevector = statevector + "\"0\"";
-        else if (final_re == 0)
-            statevector = statevector + "\"" + std::to_string(final_im) + "i\"";
-        else if (final_im == 0)
-            statevector = statevector + "\"" + std::to_string(final_re) + "\"";
+/**Function*************************************************************
+
+  Synopsis    [Weighted sum of the terms measured in the current basis]
+
+  Description [Every term is read as a Z string on its non-identity
+               qubits, so the basis change of the terms must already be
+               applied. Each term is one tuple_sum with SUM_SIGN on its
+               qubits, over the tuple nodes shared by all terms.]
+
+  SideEffects []
+
+  SeeAlso     [tuple_sum getExpectVal]
+
+***********************************************************************/
+double Simulator::expval_group(std::vector<int> &terms)
+{
+    double oneroot2 = 1 / sqrt(2);
+    double H_factor = pow(oneroot2, k%2);
+    int root = tuple_root();
+
+    double value = 0;
+    for (int t : terms)
+    {
+        std::vector<int> mode(n, SUM_FREE);
+        int last = -1;
+        for (int q = 0; q < n; q++)
+            if (expval_terms[t].second[q] != 'I')
+            {
+                mode[q] = SUM_SIGN;
+                last = std::max(last, Cudd_ReadPerm(manager, q));
+            }
+        tuple_sum_reset();
+        double sum = tuple_sum(root, 0, mode, last);
+        value += expval_terms[t].first * sum * H_factor * H_factor * rus_normalize_factor * rus_normalize_factor;
+    }
+
+    tuple_clear();
+    return value;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Expectation value of the weighted Pauli strings]
+
+  Description [Terms are grouped by the letters they have on X and Y;
+               the Z strings form the first group and read the state as
+               is. For any other group the basis change (H for X, S^dag
+               then H for Y) is applied to a copy of the state vector,
+               which only costs a reference per slice, and the copy is
+               dropped afterwards. The state is left untouched.]
+
+  SideEffects []
+
+  SeeAlso     [expval_group]
+
+***********************************************************************/
+void Simulator::getExpectVal()
+{
+    std::map<std::string, std::vector<int>> groups; // key: X and Y letters of the terms, Z elsewhere
+    for (int t = 0; t < expval_terms.size(); t++)
+    {
+        std::string basis = expval_terms[t].second;
+        for (int q = 0; q < n; q++)
+            if (basis[q] == 'I')
+                basis[q] = 'Z';
+        groups[basis].push_back(t);
+    }
+
+    expval = 0;
+    for (std::map<std::string, std::vector<int>>::iterator it = groups.begin(); it != groups.end(); it++)
+    {
+        if (it->first == std::string(n, 'Z'))
+        {
+            expval += expval_group(it->second);
+            continue;
+        }
+
+        DdNode ***Saved_Bdd = All_Bdd;
+        int r_saved = r, k_saved = k, shift_saved = shift;
+        unsigned long gatecount_saved = gatecount;
+        All_Bdd = copy_bdd();
+
+        for (int q = 0; q < n; q++)
+        {
+            if (it->first[q] == 'Y')
+                gate1({GATE_PHASE, 0, -w / 2}, q);
+            if (it->first[q] != 'Z')
+                gate1({GATE_H, 0, 0}, q);
+        }
+        flush_gates();
+        expval += expval_group(it->second);
+
+        free_bdd(All_Bdd, r);
+        All_Bdd = Saved_Bdd;
+        r = r_saved;
+        k = k_saved;
+        shift = shift_saved;
+        gatecount = gatecount_saved;
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [measurement]
+
+  Description [Sampling or, in probability mode, the exact distribution
+               of the measured qubits, on whatever levels the variable
+               order puts them.]
+
+  SideEffects []
+
+  SeeAlso     [sample_counts marginal_probs]
+
+***********************************************************************/
+void Simulator::measurement()
+{
+    double oneroot2 = 1 / sqrt(2);
+    double H_factor = pow(oneroot2, k%2);
+
+    if (isReorder) Cudd_AutodynDisable(manager);
+
+    int last = -1; // lowest measured level
+    measured_above.assign(n + 1, 0);
+    for (int i = 0; i < n; i++)
+    {
+        bool isMeasured = !measured_qubits_to_clbits[Cudd_ReadInvPerm(manager, i)].empty();
+        measured_above[i + 1] = measured_above[i] + isMeasured;
+        if (isMeasured)
+            last = i;
+    }
+
+    int root = tuple_root();
+    Frontier frontier(1, std::make_pair(root, pow(2, Tuple_Node[root].position)));
+    std::string measure_outcome_qubits(n, '0');
+    double factor = H_factor * H_factor * rus_normalize_factor * rus_normalize_factor;
+    std::map<std::string, std::pair<int, double>> records = clbit_records;
+    if (records.empty())
+        records[std::string(nClbits, '0')] = std::make_pair(shots, 1.0);
+    if (sim_type == 2 && marginal_prob.empty())
+        marginal_prob.assign(1ULL << nClbits, 0);
+    std::map<std::string, std::pair<int, double>>::iterator it;
+    for (it = records.begin(); it != records.end(); it++)
+    {
+        clbit_record = it->first;
+        if (sim_type == 2)
+            marginal_probs(frontier, 0, it->second.second, last, factor * it->second.second, measure_outcome_qubits);
+        else if (top_k > 0)
+            top_outcomes(root, last, factor);
+        else if (it->second.first > 0)
+            sample_counts(frontier, 0, it->second.first, 1, last, factor, measure_outcome_qubits);
+    }
+    tuple_clear();
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Write the amplitudes below tuple into amp]
+
+  Description [tuple sits at level position and index holds the qubits
+               above it. A level no slice depends on is walked without
+               cofactoring, and a tuple of constants is decoded once for
+               all the entries below it. level_value is that of
+               amplitude_tables; the other branch of a measured qubit is
+               left 0. stack[l] is the scratch tuple of level l. Only reads the BDDs, so several threads can
+               run it on disjoint parts of amp.]
+
+  SideEffects []
+
+  SeeAlso     [amplitude_spread amplitude_worker]
+
+***********************************************************************/
+void Simulator::amplitude_fill(const SliceTuple &tuple, int position, unsigned long long index, const std::vector<int> &level_value, std::vector<SliceTuple> &stack, std::complex<double> *amp)
+{
+    int top = n;
+    for (int h = 0; h < tuple.size(); h++)
+        if (!Cudd_IsConstant(tuple[h].first))
+            top = std::min(top, Cudd_ReadPerm(manager, Cudd_NodeReadIndex(tuple[h].first)));
+    if (top == n)
+    {
+        std::complex<double> value = (r > 53) ? tuple_amplitude_gmp(tuple.data()) : tuple_amplitude(tuple.data());
+        amplitude_spread(value * amp_factor, position, index, level_value, amp);
+        return;
+    }
+
+    int q = Cudd_ReadInvPerm(manager, position);
+    for (int value = 0; value < 2; value++)
+    {
+        if (level_value[position] == 1 - value)
+            continue;
+        unsigned long long child_index = index | ((unsigned long long) value << q);
+        if (top == position)
+        {
+            tuple_cofactor(tuple.data(), tuple.size(), q, value, stack[position]);
+            amplitude_fill(stack[position], position + 1, child_index, level_value, stack, amp);
+        }
         else
+            amplitude_fill(tuple, position + 1, child_index, level_value, stack, amp);
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Write value to every entry below level position]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     [amplitude_fill]
+
+***********************************************************************/
+void Simulator::amplitude_spread(std::complex<double> value, int position, unsigned long long index, const std::vector<int> &level_value, std::complex<double> *amp)
+{
+    if (position == n)
+    {
+        amp[index] = value;
+        return;
+    }
+    int q = Cudd_ReadInvPerm(manager, position);
+    if (level_value[position] != 1)
+        amplitude_spread(value, position + 1, index, level_value, amp);
+    if (level_value[position] != 0)
+        amplitude_spread(value, position + 1, index | (1ULL << q), level_value, amp);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Fill the parts of amp handed out by next]
+
+  Description [Part t fixes the qubits of the top nsplit levels to the
+               bits of t.]
+
+  SideEffects []
+
+  SeeAlso     [amplitude_fill getStatevector]
+
+***********************************************************************/
+void Simulator::amplitude_worker(const SliceTuple *root, int nsplit, const std::vector<int> *level_value, std::atomic<unsigned long long> *next, std::complex<double> *amp)
+{
+    std::vector<SliceTuple> stack(n + nsplit); // levels of amplitude_fill, then those of the split
+    for (unsigned long long t = (*next)++; t < (1ULL << nsplit); t = (*next)++)
+    {
+        const SliceTuple *tuple = root;
+        unsigned long long index = 0;
+        bool isZero = false;
+        for (int l = 0; l < nsplit && !isZero; l++)
         {
-            if (final_im < 0)
-                statevector = statevector + "\"" + std::to_string(final_re) + std::to_string(final_im) + "i\"";
-            else
-                statevector = statevector + "\"" + std::to_string(final_re) + "+" + std::to_string(final_im) + "i\"";
+            int q = Cudd_ReadInvPerm(manager, l), value = (t >> l) & 1;
+            isZero = ((*level_value)[l] == 1 - value);
+            index |= (unsigned long long) value << q;
+            tuple_cofactor(tuple->data(), tuple->size(), q, value, stack[n + l]);
+            tuple = &stack[n + l];
+        }
+        if (!isZero)
+            amplitude_fill(*tuple, nsplit, index, *level_value, stack, amp);
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Set up the decoding of the amplitudes]
+
+  Description [Sets amp_factor and, for r above 53 bits, the coefficients
+               of tuple_amplitude_gmp. level_value[l] is the value the
+               qubit at level l was measured to, -1 if not measured or
+               if measurement has not picked an outcome yet.]
+
+  SideEffects []
+
+  SeeAlso     [decode_amplitudes getSparseStatevector]
+
+***********************************************************************/
+void Simulator::amplitude_tables(std::vector<int> &level_value)
+{
+    amp_factor = pow(1 / sqrt(2), k % 2) * normalize_factor * rus_normalize_factor;
+    level_value.assign(n, -1);
+    for (int l = 0; l < n && !measure_outcome.empty(); l++)
+    {
+        int q = Cudd_ReadInvPerm(manager, l);
+        if (!measured_qubits_to_clbits[q].empty())
+            level_value[l] = measure_outcome[n - 1 - q] - '0';
+    }
+    if (r <= 53)
+        return;
+
+    leaf_re_gmp.assign(w, mpf_class(0, r + 64));
+    leaf_im_gmp.assign(w, mpf_class(0, r + 64));
+    mpf_class one_over_sqrt_2(0.5, r + 64);
+    mpf_sqrt(one_over_sqrt_2.get_mpf_t(), one_over_sqrt_2.get_mpf_t());
+    for (int e = 1; e < w/2; e++) // the ones tuple_amplitude_gmp reads
+    {
+        if (4 * e == w)
+            leaf_re_gmp[w - 1 - e] = leaf_im_gmp[w - 1 - e] = one_over_sqrt_2;
+        else
+        {
+            leaf_re_gmp[w - 1 - e] = cos((double) e / w * PI);
+            leaf_im_gmp[w - 1 - e] = sin((double) e / w * PI);
         }
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Decode all 2^n amplitudes into amp]
+
+  Description [Entry i has qubit j in bit j. Integers of up to 53 bits
+               are decoded in doubles, larger ones through GMP. The top
+               levels are split into parts shared out to all cores.]
+
+  SideEffects []
+
+  SeeAlso     [amplitude_worker getStatevector]
+
+***********************************************************************/
+void Simulator::decode_amplitudes(std::complex<double> *amp)
+{
+    std::vector<int> level_value;
+    amplitude_tables(level_value);
+
+    int root = tuple_root();
+    SliceTuple root_tuple(Tuple_Run.begin() + Tuple_Node[root].start, Tuple_Run.begin() + Tuple_Node[root].start + Tuple_Node[root].length);
+    int nthreads = std::max(1u, std::thread::hardware_concurrency());
+    int nsplit = 0;
+    while (nthreads > 1 && nsplit < n && (1 << nsplit) < 8 * nthreads)
+        nsplit++;
+    std::atomic<unsigned long long> next(0);
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; t++)
+        threads.push_back(std::thread(&Simulator::amplitude_worker, this, &root_tuple, nsplit, &level_value, &next, amp));
+    amplitude_worker(&root_tuple, nsplit, &level_value, &next, amp);
+    for (int t = 0; t < threads.size(); t++)
+        threads[t].join();
+    tuple_clear();
+}
+
+/**Function*************************************************************
+
+  Synopsis    [get statevector string based on BDDs]
+
+  Description [With a statevector file the amplitudes are decoded
+               straight into the file, mapped to memory, as a .npy array
+               of complex128 (little endian); statevector then only
+               holds the file name.]
+
+  SideEffects []
+
+  SeeAlso     [decode_amplitudes]
+
+***********************************************************************/
+void Simulator::getStatevector()
+{
+    unsigned long long nEntries = 1ULL << n;
+
+    if (!statevector_file.empty())
+    {
+        std::string header = "{'descr': '<c16', 'fortran_order': False, 'shape': (" + std::to_string(nEntries) + ",), }";
+        header.resize(128 - 10 - 1, ' ');
+        header = std::string("\x93NUMPY\x01\x00", 8) + char(header.size() + 1) + char(0) + header + "\n";
+        size_t size = header.size() + nEntries * sizeof(std::complex<double>);
+
+        int fd = open(statevector_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0)
+        {
+            std::cerr << "[error]Cannot write the statevector file " << statevector_file << std::endl;
+            std::exit(1);
+        }
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            std::cerr << "[error]Cannot map the statevector file " << statevector_file << std::endl;
+            std::exit(1);
+        }
+        memcpy(data, header.data(), header.size());
+        decode_amplitudes((std::complex<double> *) ((char *) data + header.size()));
+        munmap(data, size);
+        close(fd);
+        statevector = "\"" + statevector_file + "\"";
+        return;
+    }
+
+    std::vector<std::complex<double>> amp(nEntries);
+    decode_amplitudes(amp.data());
+
+    statevector = "[";
+    for (unsigned long long i = 0; i < nEntries; i++)
+    {
+        statevector += amplitude_string(amp[i]);
         if (i != nEntries - 1)
-            statevector = statevector + ", ";
-        full_adder_plus_1(n, assign);
+            statevector += ", ";
     }
     statevector += "]";
+}
+
+/**Function*************************************************************
+
+  Synopsis    [An amplitude as printed in the statevector]
+
+  Description []
+
+  SideEffects []
 
-    delete[] assign;
-}
\ No newline at end of file
+  SeeAlso     [getStatevector]
+
+***********************************************************************/
+std::string Simulator::amplitude_string(std::complex<double> amp)
+{
+    double final_re = amp.real(), final_im = amp.imag();
+    if ((final_re == 0)&&(final_im == 0))
+        return "\"0\"";
+    else if (final_re == 0)
+        return "\"" + std::to_string(final_im) + "i\"";
+    else if (final_im == 0)
+        return "\"" + std::to_string(final_re) + "\"";
+    else if (final_im < 0)
+        return "\"" + std::to_string(final_re) + std::to_string(final_im) + "i\"";
+    else
+        return "\"" + std::to_string(final_re) + "+" + std::to_string(final_im) + "i\"";
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Append the nonzero amplitudes below tuple to statevector]
+
+  Description [The sparse counterpart of amplitude_fill; outcome holds
+               the qubits above level position, q0 last. A tuple whose
+               slices are all the constant 0 is dropped, and any other
+               tuple has a nonzero amplitude below it, so the walk only
+               visits the paths to nonzero entries and their siblings.]
+
+  SideEffects []
+
+  SeeAlso     [getSparseStatevector amplitude_fill]
+
+***********************************************************************/
+void Simulator::amplitude_list(const SliceTuple &tuple, int position, std::string &outcome, const std::vector<int> &level_value, std::vector<SliceTuple> &stack, std::complex<double> value)
+{
+    int top = n;
+    bool isZero = true;
+    for (int h = 0; h < tuple.size(); h++)
+    {
+        isZero &= (tuple[h].first == Cudd_Not(Cudd_ReadOne(manager)));
+        if (!Cudd_IsConstant(tuple[h].first))
+            top = std::min(top, Cudd_ReadPerm(manager, Cudd_NodeReadIndex(tuple[h].first)));
+    }
+    if (isZero)
+        return;
+    // a tuple of constants is decoded once for the entries below it; value
+    // is 0 until then, since those that are not all 0 never decode to 0
+    if (top == n && value == std::complex<double>(0, 0))
+        value = ((r > 53) ? tuple_amplitude_gmp(tuple.data()) : tuple_amplitude(tuple.data())) * amp_factor;
+    if (position == n)
+    {
+        statevector += (statevector == "{ ") ? "\"" : ", \"";
+        statevector += outcome + "\": " + amplitude_string(value);
+        return;
+    }
+
+    int q = Cudd_ReadInvPerm(manager, position);
+    for (int bit = 0; bit < 2; bit++)
+    {
+        if (level_value[position] == 1 - bit)
+            continue;
+        outcome[n - 1 - q] = '0' + bit;
+        if (top == position)
+        {
+            tuple_cofactor(tuple.data(), tuple.size(), q, bit, stack[position]);
+            amplitude_list(stack[position], position + 1, outcome, level_value, stack, value);
+        }
+        else
+            amplitude_list(tuple, position + 1, outcome, level_value, stack, value);
+    }
+    outcome[n - 1 - q] = '0';
+}
+
+/**Function*************************************************************
+
+  Synopsis    [get the nonzero amplitudes as an object from basis states
+               to amplitudes]
+
+  Description [Used by sparse_amplitude mode. The basis states are
+               written as the measurement outcomes are, q0 last, and
+               come in the order of the BDD levels.]
+
+  SideEffects []
+
+  SeeAlso     [amplitude_list getStatevector]
+
+***********************************************************************/
+void Simulator::getSparseStatevector()
+{
+    std::vector<int> level_value;
+    amplitude_tables(level_value);
+
+    int root = tuple_root();
+    SliceTuple root_tuple(Tuple_Run.begin() + Tuple_Node[root].start, Tuple_Run.begin() + Tuple_Node[root].start + Tuple_Node[root].length);
+    std::vector<SliceTuple> stack(n);
+    std::string outcome(n, '0');
+    statevector = "{ ";
+    amplitude_list(root_tuple, 0, outcome, level_value, stack, 0);
+    statevector += (statevector == "{ ") ? "}" : " }";
+    tuple_clear();
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Exact amplitudes and probabilities of the basis states in
+               query_states]
+
+  Description [Each basis state is one path: the slice tuple is
+               cofactored level by level along its bits (q0 last) and the
+               constants it reaches are decoded, O(n * w * r) per state.
+               Run before measurement, so the final measure operations
+               are not applied.]
+
+  SideEffects [Sets query_result.]
+
+  SeeAlso     [amplitude_tables tuple_amplitude]
+
+***********************************************************************/
+void Simulator::getQueries()
+{
+    std::vector<int> level_value;
+    amplitude_tables(level_value);
+
+    int root = tuple_root();
+    SliceTuple tuple, child;
+    std::ostringstream query_ss;
+    query_ss.precision(17);
+    query_ss << "{ ";
+    for (int i = 0; i < query_states.size(); i++)
+    {
+        std::string &bits = query_states[i];
+        if (bits.size() != n || bits.find_first_not_of("01") != std::string::npos)
+        {
+            std::cerr << "[error]Query " << bits << " is not a basis state of " << n << " qubits" << std::endl;
+            std::exit(1);
+        }
+        tuple.assign(Tuple_Run.begin() + Tuple_Node[root].start, Tuple_Run.begin() + Tuple_Node[root].start + Tuple_Node[root].length);
+        for (int l = 0; l < n; l++)
+        {
+            int q = Cudd_ReadInvPerm(manager, l);
+            tuple_cofactor(tuple.data(), tuple.size(), q, bits[n - 1 - q] - '0', child);
+            tuple.swap(child);
+        }
+        std::complex<double> amp = ((r > 53) ? tuple_amplitude_gmp(tuple.data()) : tuple_amplitude(tuple.data())) * amp_factor;
+        query_ss << (i ? ", \"" : "\"") << bits << "\": { \"amplitude\": " << amplitude_string(amp)
+                 << ", \"probability\": " << std::norm(amp) << " }";
+    }
+    query_ss << " }";
+    query_result = query_ss.str();
+    tuple_clear();
+}
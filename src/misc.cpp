@@ -1,5 +1,6 @@
 #include "Simulator.h"
 #include "util_sim.h"
+#include <algorithm> // sort
 
 
 /**Function*************************************************************
@@ -55,196 +56,316 @@ void Simulator::init_state(int *constants)
 }
 
 /**Function*************************************************************
-  Synopsis    [initialize state vector by a initial state matrix]
-  Description [state matrix : w x 2^n integer matrix.
-               E.g. state[3][0] means the d component of coefficient of the first basis state]
-  SideEffects []
-  SeeAlso     []
+
+  Synopsis    [initialize state vector by the amplitudes of initial_state]
+
+  Description [The real parts go to the integers of omega^0 and the
+               imaginary parts to those of omega^(w/2); bit b of these
+               integers over all basis states is slice b. The slices are
+               built bottom-up along the current variable order by
+               state_bdd, so the cost follows the nonzero amplitudes
+               times n instead of one n-literal minterm per set bit.
+               The state being replaced is freed.]
+
+  SideEffects [Dynamic reordering is suspended while the slices are built]
+
+  SeeAlso     [state_bdd]
+
 ***********************************************************************/
-void Simulator::init_state_by_matrix(int state_k, std::vector<std::vector<int>>& state)
+void Simulator::init_state_by_matrix(int state_k, const InitialState &state)
 {
     this->k = state_k;
 
-    // DdNode *var, *tmp;
-    All_Bdd = new DdNode **[w];
-    for (int i = 0; i < w; i++)
-        All_Bdd[i] = new DdNode *[r];
+    std::vector<unsigned long long> index(state.index);
+    std::sort(index.begin(), index.end());
+    if (std::adjacent_find(index.begin(), index.end()) != index.end())
+    {
+        std::cerr << "[error]initial_state lists basis state " << *std::adjacent_find(index.begin(), index.end()) << " more than once" << std::endl;
+        std::exit(1);
+    }
 
-    // For each a,b,c,d
+    free_bdd(All_Bdd, r);
+    All_Bdd = new DdNode **[w];
     for (int i = 0; i < w; i++)
     {
-        // Initialize r BDDs to constant 0
-        for (int b=0; b<r; b++)
+        All_Bdd[i] = new DdNode *[r];
+        for (int b = 0; b < r; b++)
         {
             All_Bdd[i][b] = Cudd_Not(Cudd_ReadOne(manager));
             Cudd_Ref(All_Bdd[i][b]);
         }
-        // For each basis state
-        for (int j = 0;j < pow(2,n);j++)
+    }
+
+    // the key of a basis state holds the value of level 0 in its top bit, so a sorted range splits at each level
+    Cudd_AutodynDisable(manager);
+    std::vector<int> level_var(n);
+    for (int level = 0; level < n; level++)
+        level_var[level] = Cudd_ReadInvPerm(manager, level);
+    std::vector<DdNode *> scratch(2 * r * (n + 1));
+    for (int part = 0; part < 2; part++)
+    {
+        int i = (part == 0) ? w - 1 : w / 2 - 1; // real part to omega^0, imaginary part to omega^(w/2)
+        std::vector<std::pair<unsigned long long, int>> entries;
+        for (int e = 0; e < state.index.size(); e++)
         {
-            int state_int = state[i][j];
-            // For each bit in the integer
-            for (int b=0; b<r; b++)
-            {
-                // Add minterm if needed
-                if ((state_int >> b)%2 == 0)
-                    continue;
-                else
-                {
-                    // Convert j to its bit string
-                    std::string state_str(n,'0');
-                    for (int x = n-1; x >= 0; x--)
-                    {
-                        if ((j >> x)%2 == 0)
-                            continue;
-                        else
-                        {
-                            state_str[x] = '1';
-                        }
-                    }
-                    // Create the minterm and OR it to the BDD All_Bdd[i][b]
-                    DdNode *var, *tmp, *tmp_term;
-                    tmp_term = Cudd_ReadOne(manager);
-                    Cudd_Ref(tmp_term);
-                    for (int x = n-1; x >= 0; x--)
-                    {
-                        var = Cudd_bddIthVar(manager, x);
-                        if (state_str[x] == '0')
-                            tmp = Cudd_bddAnd(manager, Cudd_Not(var), tmp_term);
-                        else
-                            tmp = Cudd_bddAnd(manager, var, tmp_term);
-                        Cudd_Ref(tmp);
-                        Cudd_RecursiveDeref(manager, tmp_term);
-                        tmp_term = tmp;
-                    }
-                    tmp = Cudd_bddOr(manager,All_Bdd[i][b], tmp_term);
-                    Cudd_Ref(tmp);
-                    Cudd_RecursiveDeref(manager, All_Bdd[i][b]);
-                    All_Bdd[i][b] = tmp;
-                }
-            }
+            if (state.value[2 * e + part] == 0)
+                continue;
+            unsigned long long key = 0;
+            for (int level = 0; level < n; level++)
+                if ((state.index[e] >> level_var[level]) & 1)
+                    key |= 1ULL << (n - 1 - level);
+            entries.push_back(std::make_pair(key, state.value[2 * e + part]));
         }
+        std::sort(entries.begin(), entries.end());
+
+        for (int b = 0; b < r; b++)
+            Cudd_RecursiveDeref(manager, All_Bdd[i][b]);
+        state_bdd(entries, 0, entries.size(), 0, All_Bdd[i], scratch.data());
     }
+    if (isReorder) Cudd_AutodynEnable(manager, CUDD_REORDER_SYMM_SIFT);
 }
 
 /**Function*************************************************************
 
-  Synopsis    [allocate new BDDs for each integer vector]
+  Synopsis    [Build the r slices of the amplitudes in entries[lo, hi)]
 
-  Description []
+  Description [entries are sorted by key, see init_state_by_matrix, and
+               all keys of the range agree above level. out[b] is set to
+               the referenced BDD of bit b of the integers, where a
+               missing basis state is 0 and bits above 31 copy the sign.
+               Both cofactors are built first and the node is then found
+               or added in the unique table, so equal subfunctions are
+               shared as they are built. scratch holds 2 * r nodes per
+               level below.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [init_state_by_matrix]
 
 ***********************************************************************/
-void Simulator::alloc_BDD(DdNode ***Bdd, bool extend)
+void Simulator::state_bdd(const std::vector<std::pair<unsigned long long, int>> &entries, int lo, int hi, int level, DdNode **out, DdNode **scratch)
 {
-    DdNode *tmp;
-
-    DdNode ***W = new DdNode **[w];
-    for (int i = 0; i < w; i++)
-        W[i] = new DdNode *[r];
-
-    for (int i = 0; i < r - inc; i++)
-        for (int j = 0; j < w; j++)
-            W[j][i] = Bdd[j][i];
-
-    for (int i = 0; i < w; i++)
-        delete[] Bdd[i];
+    DdNode *one = Cudd_ReadOne(manager);
+    if (lo == hi || level == n)
+    {
+        for (int b = 0; b < r; b++)
+        {
+            bool bit = lo < hi && ((entries[lo].second >> std::min(b, 31)) & 1);
+            out[b] = bit ? one : Cudd_Not(one);
+            Cudd_Ref(out[b]);
+        }
+        return;
+    }
 
-    for (int i = 0; i < w; i++)
-        Bdd[i] = W[i];
+    unsigned long long mask = 1ULL << (n - 1 - level);
+    int below = lo, above = hi; // first entry with the bit of level set
+    while (below < above)
+    {
+        int mid = below + (above - below) / 2;
+        if (entries[mid].first & mask)
+            above = mid;
+        else
+            below = mid + 1;
+    }
+    DdNode **T = scratch, **E = scratch + r;
+    state_bdd(entries, below, hi, level + 1, T, scratch + 2 * r);
+    state_bdd(entries, lo, below, level + 1, E, scratch + 2 * r);
 
-    if (extend)
+    int index = Cudd_ReadInvPerm(manager, level);
+    for (int b = 0; b < r; b++)
     {
-        for (int i = r - inc; i < r; i++)
+        if (T[b] == E[b])
         {
-            for (int j = 0; j < w; j++)
-            {
-                Bdd[j][i] = Cudd_ReadOne(manager);
-                Cudd_Ref(Bdd[j][i]);
-                tmp = Cudd_bddAnd(manager, Bdd[j][r - inc - 1], Bdd[j][i]);
-                Cudd_Ref(tmp);
-                Cudd_RecursiveDeref(manager, Bdd[j][i]);
-                Bdd[j][i] = tmp;
-            }
+            out[b] = T[b];
+            Cudd_RecursiveDeref(manager, E[b]);
+            continue;
+        }
+        // the then child of a node is regular
+        bool isNot = Cudd_IsComplement(T[b]);
+        DdNode *node = cuddUniqueInter(manager, index, Cudd_NotCond(T[b], isNot), Cudd_NotCond(E[b], isNot));
+        if (node == NULL)
+        {
+            std::cerr << "[error]Out of memory while building the initial state" << std::endl;
+            std::exit(1);
         }
+        out[b] = Cudd_NotCond(node, isNot);
+        Cudd_Ref(out[b]);
+        Cudd_RecursiveDeref(manager, T[b]);
+        Cudd_RecursiveDeref(manager, E[b]);
     }
 }
 
 /**Function*************************************************************
 
-  Synopsis    [Drop LSB and shift right by 1 bit]
+  Synopsis    [initialize state vector by an init instruction]
 
-  Description []
+  Description [plus and basis put the listed qubits in |+> or |1> and
+               the others in |0>, ghz is (|0...0> + |1...1>)/sqrt(2) and
+               dicke the uniform superposition of the basis states with
+               op.m ones, W for op.m = 1.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [init_state_uniform]
 
 ***********************************************************************/
-void Simulator::dropLSB(DdNode ***Bdd)
+void Simulator::init_state_by_op(const CircuitOp &op)
 {
-    DdNode *tmp;
+    Cudd_AutodynDisable(manager);
+    DdNode *support;
+    double log2count = 0; // of the basis states in support
+    if (op.code == OP_INIT_PLUS || op.code == OP_INIT_BASIS)
+    {
+        std::vector<int> value(n, 0);
+        for (int i = op.start; i < op.start + op.count; i++)
+            value[Circuit.operands[i]] = (op.code == OP_INIT_PLUS) ? -1 : 1;
+        for (int q = 0; q < n; q++)
+            log2count += (value[q] == -1);
+        support = cube_bdd(value);
+    }
+    else if (op.code == OP_INIT_GHZ)
+    {
+        DdNode *zeros = cube_bdd(std::vector<int>(n, 0));
+        DdNode *ones = cube_bdd(std::vector<int>(n, 1));
+        support = Cudd_bddOr(manager, zeros, ones);
+        Cudd_Ref(support);
+        Cudd_RecursiveDeref(manager, zeros);
+        Cudd_RecursiveDeref(manager, ones);
+        log2count = (n > 0);
+    }
+    else
+    {
+        for (int i = 1; i <= op.m; i++)
+            log2count += log2((double) (n - op.m + i) / i); // C(n, m)
+        support = weight_bdd(op.m);
+    }
+    init_state_uniform(support, log2count);
+    if (isReorder) Cudd_AutodynEnable(manager, CUDD_REORDER_SYMM_SIFT);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [initialize state vector to the uniform superposition of
+               the basis states in support]
+
+  Description [support is referenced and consumed, and holds 2^log2count
+               basis states. The amplitude is exact, 1 with k =
+               log2count, if log2count is an integer; otherwise it is
+               rounded to INITIAL_STATE_PRECISION significant bits with
+               an even k. Only the slices of omega^0 are nonzero, each
+               either support or 0. If the integer does not fit in r
+               bits, r grows by inc bits at a time as in store_sum
+               (isAlloc), else it is an error.]
+
+  SideEffects [r may grow]
+
+  SeeAlso     [init_state_by_op]
 
+***********************************************************************/
+void Simulator::init_state_uniform(DdNode *support, double log2count)
+{
+    long long value = 1;
+    if (fabs(log2count - round(log2count)) < 1e-9)
+        k = round(log2count);
+    else
+    {
+        int half = ceil(log2count / 2);
+        k = 2 * (INITIAL_STATE_PRECISION + half);
+        value = llround(pow(2, INITIAL_STATE_PRECISION + half - log2count / 2));
+    }
+    int need = 2; // bits of value and a sign bit
+    while (value >> (need - 1))
+        need++;
+    if (need > r && !isAlloc)
+    {
+        std::cerr << "[error]init needs an integer bit size of at least " << need << ", got --r " << r << std::endl;
+        std::exit(1);
+    }
+
+    free_bdd(All_Bdd, r);
+    if (need > r)
+        r += inc * ((need - r + inc - 1) / inc);
+    All_Bdd = new DdNode **[w];
     for (int i = 0; i < w; i++)
     {
-        Cudd_RecursiveDeref(manager, Bdd[i][0]); // drop LSB
-        // right shift
-        for (int j = 1; j < r; j++)
+        All_Bdd[i] = new DdNode *[r];
+        for (int b = 0; b < r; b++)
         {
-            Bdd[i][j - 1] = Bdd[i][j];
+            All_Bdd[i][b] = (i == w - 1 && b < 62 && ((value >> b) & 1)) ? support : Cudd_Not(Cudd_ReadOne(manager));
+            Cudd_Ref(All_Bdd[i][b]);
         }
-        // sign extension
-        Bdd[i][r - 1] = Cudd_ReadOne(manager);
-        Cudd_Ref(Bdd[i][r - 1]);
-        tmp = Cudd_bddAnd(manager, Bdd[i][r - 2], Bdd[i][r - 1]);
-        Cudd_Ref(tmp);
-        Cudd_RecursiveDeref(manager, Bdd[i][r - 1]);
-        Bdd[i][r - 1] = tmp;
     }
+    Cudd_RecursiveDeref(manager, support);
 }
 
 /**Function*************************************************************
 
-  Synopsis    [detect overflow in integer vectors]
+  Synopsis    [BDD of the basis states where qubit q has value[q]]
 
-  Description []
+  Description [value[q] is 0 or 1, or -1 if qubit q is free. The cube is
+               built from the bottom level up, so each conjunction only
+               adds a node on top. The result is referenced.]
 
   SideEffects []
 
-  SeeAlso     []
+  SeeAlso     [init_state_by_op]
 
 ***********************************************************************/
-int Simulator::overflow3(DdNode *g, DdNode *h, DdNode *crin)
+DdNode *Simulator::cube_bdd(const std::vector<int> &value)
 {
-    DdNode *tmp, *dd1, *dd2;
-    int overflow;
+    DdNode *cube = Cudd_ReadOne(manager), *tmp;
+    Cudd_Ref(cube);
+    for (int level = n - 1; level >= 0; level--)
+    {
+        int q = Cudd_ReadInvPerm(manager, level);
+        if (value[q] == -1)
+            continue;
+        tmp = Cudd_bddAnd(manager, Cudd_NotCond(Cudd_bddIthVar(manager, q), value[q] == 0), cube);
+        Cudd_Ref(tmp);
+        Cudd_RecursiveDeref(manager, cube);
+        cube = tmp;
+    }
+    return cube;
+}
 
-    dd1 = Cudd_bddXor(manager, g, crin);
-    Cudd_Ref(dd1);
+/**Function*************************************************************
 
-    dd2 = Cudd_bddXnor(manager, g, h);
-    Cudd_Ref(dd2);
+  Synopsis    [BDD of the basis states with weight qubits in |1>]
 
-    tmp = Cudd_bddAnd(manager, dd1, dd2);
-    Cudd_Ref(tmp);
-    Cudd_RecursiveDeref(manager, dd1);
-    Cudd_RecursiveDeref(manager, dd2);
+  Description [Built from the bottom level up: count[c] holds the states
+               of the levels below with c ones, so the result has
+               O(n * weight) nodes. The result is referenced.]
 
-    if (Cudd_CountPathsToNonZero(tmp))
-        overflow = 1;
-    else
-        overflow = 0;
-    Cudd_RecursiveDeref(manager, tmp);
+  SideEffects []
+
+  SeeAlso     [init_state_by_op]
 
-    return overflow;
+***********************************************************************/
+DdNode *Simulator::weight_bdd(int weight)
+{
+    std::vector<DdNode *> count(weight + 1, Cudd_Not(Cudd_ReadOne(manager)));
+    count[0] = Cudd_ReadOne(manager);
+    for (int c = 0; c <= weight; c++)
+        Cudd_Ref(count[c]);
+    for (int level = n - 1; level >= 0; level--)
+    {
+        DdNode *var = Cudd_bddIthVar(manager, Cudd_ReadInvPerm(manager, level));
+        for (int c = weight; c >= 0; c--)
+        {
+            DdNode *tmp = Cudd_bddIte(manager, var, c > 0 ? count[c - 1] : Cudd_Not(Cudd_ReadOne(manager)), count[c]);
+            Cudd_Ref(tmp);
+            Cudd_RecursiveDeref(manager, count[c]);
+            count[c] = tmp;
+        }
+    }
+    for (int c = 0; c < weight; c++)
+        Cudd_RecursiveDeref(manager, count[c]);
+    return count[weight];
 }
 
 /**Function*************************************************************
 
-  Synopsis    [detect overflow in integer vectors -- for the case that h is 0]
+  Synopsis    [allocate new BDDs for each integer vector]
 
   Description []
 
@@ -253,20 +374,39 @@ int Simulator::overflow3(DdNode *g, DdNode *h, DdNode *crin)
   SeeAlso     []
 
 ***********************************************************************/
-int Simulator::overflow2(DdNode *g, DdNode *crin){
+void Simulator::alloc_BDD(DdNode ***Bdd, bool extend)
+{
     DdNode *tmp;
-    int overflow;
 
-    tmp = Cudd_bddAnd(manager, Cudd_Not(g), crin);
-    Cudd_Ref(tmp);
+    DdNode ***W = new DdNode **[w];
+    for (int i = 0; i < w; i++)
+        W[i] = new DdNode *[r];
 
-    if (Cudd_CountPathsToNonZero(tmp))
-        overflow = 1;
-    else
-        overflow = 0;
-    Cudd_RecursiveDeref(manager, tmp);
+    for (int i = 0; i < r - inc; i++)
+        for (int j = 0; j < w; j++)
+            W[j][i] = Bdd[j][i];
+
+    for (int i = 0; i < w; i++)
+        delete[] Bdd[i];
 
-    return overflow;
+    for (int i = 0; i < w; i++)
+        Bdd[i] = W[i];
+
+    if (extend)
+    {
+        for (int i = r - inc; i < r; i++)
+        {
+            for (int j = 0; j < w; j++)
+            {
+                Bdd[j][i] = Cudd_ReadOne(manager);
+                Cudd_Ref(Bdd[j][i]);
+                tmp = Cudd_bddAnd(manager, Bdd[j][r - inc - 1], Bdd[j][i]);
+                Cudd_Ref(tmp);
+                Cudd_RecursiveDeref(manager, Bdd[j][i]);
+                Bdd[j][i] = tmp;
+            }
+        }
+    }
 }
 
 /**Function*************************************************************
@@ -390,9 +530,64 @@ void Simulator::print_info(double runtime, size_t memPeak)
     //     std::cout << "      " << it->first << ": " << it->second << std::endl;
 }
 
-// using VQE
-void Simulator::setVQEParam(int _res, bool _usingVQE)
+// resolution of rz angles, checked by main
+void Simulator::setVQEParam(int _res)
 {
+    assert(_res >= 2 && (_res & (_res - 1)) == 0);
     res = _res;
-    usingVQE = _usingVQE;
+    w = 2 * res;
+}
+
+// .npy output of all_amplitude mode
+void Simulator::setStatevectorFile(std::string path)
+{
+    statevector_file = path;
+}
+
+// most probable outcomes instead of sampling
+void Simulator::setTopK(int k)
+{
+    top_k = k;
+}
+
+// compiled circuits are kept in dir, keyed by the hash of the qasm text
+void Simulator::setCircuitCache(std::string dir)
+{
+    circuit_cache = dir;
+}
+
+// basis states whose amplitudes are queried
+void Simulator::setQuery(std::string states)
+{
+    std::stringstream states_ss(states);
+    std::string state;
+    while (getline(states_ss, state, ','))
+        if (!state.empty())
+            query_states.push_back(state);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Read the angle of a rotation gate as a multiple of unit]
+
+  Description [gate is the gate token, e.g. "rz(pi/4)". Angles that are
+               not a multiple of unit are rounded to the nearest one.]
+
+  SideEffects []
+
+  SeeAlso     []
+
+***********************************************************************/
+int Simulator::angle_multiple(std::string gate, double unit)
+{
+    size_t left = gate.find('('), right = gate.rfind(')');
+    double angle = parse_angle(gate.substr(left + 1, right - left - 1));
+    int m = (int)std::round(angle / unit);
+    if (std::abs(angle - m * unit) > 1e-9)
+    {
+        std::cerr << std::endl
+                << "[warning]: Angle of \'" << gate << "\' is not a multiple of pi/" << (int)std::round(PI / unit)
+                << ". It is rounded to " << m << "*pi/" << (int)std::round(PI / unit) << " ..." << std::endl;
+    }
+    return m;
 }
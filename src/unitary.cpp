@@ -0,0 +1,430 @@
+#include "Simulator.h"
+#include "util_sim.h"
+
+
+/**Function*************************************************************
+
+  Synopsis    [Product of a and b in Z[omega], omega^w = -1]
+
+  Description [Elements are the coefficients of omega^0 .. omega^(w-1).]
+
+  SideEffects []
+
+  SeeAlso     []
+
+***********************************************************************/
+static std::vector<long long> ring_mul(const std::vector<long long> &a, const std::vector<long long> &b)
+{
+    int w = a.size();
+    std::vector<long long> c(w, 0);
+    for (int s = 0; s < w; s++)
+    {
+        if (a[s] == 0)
+            continue;
+        for (int t = 0; t < w; t++)
+        {
+            if (s + t < w)
+                c[s + t] += a[s] * b[t];
+            else
+                c[s + t - w] -= a[s] * b[t];
+        }
+    }
+    return c;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [omega^m in Z[omega]]
+
+  Description []
+
+  SideEffects []
+
+  SeeAlso     []
+
+***********************************************************************/
+static std::vector<long long> ring_omega(int w, int m)
+{
+    std::vector<long long> e(w, 0);
+    m = ((m % (2 * w)) + 2 * w) % (2 * w);
+    e[m % w] = (m < w) ? 1 : -1;
+    return e;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Non-adjacent form of e, LSB first]
+
+  Description [Digits are in {-1, 0, 1} and no two adjacent digits are
+               nonzero, so e costs the fewest additions.]
+
+  SideEffects []
+
+  SeeAlso     []
+
+***********************************************************************/
+static std::vector<int> naf(long long e)
+{
+    std::vector<int> d;
+    while (e != 0)
+    {
+        int z = 0;
+        if (e & 1)
+        {
+            z = 2 - (int)(((e % 4) + 4) % 4);
+            e -= z;
+        }
+        d.push_back(z);
+        e /= 2;
+    }
+    return d;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Signed-digit terms of an exact 2x2 matrix]
+
+  Description [Each term {s, p, src, d0, d1} adds d_x * 2^p * omega^s
+               times the src cofactor (0 for x = 0, 1 for x = 1) to the
+               branch x of the output. d0 and d1 share one term whenever
+               both rows have a digit at the same place.]
+
+  SideEffects []
+
+  SeeAlso     [Unitary]
+
+***********************************************************************/
+static std::vector<std::vector<int>> unitary_terms(const std::vector<std::vector<long long>> &M)
+{
+    std::vector<std::vector<int>> term;
+    int w = M[0].size();
+    for (int src = 0; src < 2; src++)
+        for (int s = 0; s < w; s++)
+        {
+            std::vector<int> naf0 = naf(M[src][s]), naf1 = naf(M[2 + src][s]);
+            for (int p = 0; p < std::max(naf0.size(), naf1.size()); p++)
+            {
+                int d0 = (p < naf0.size()) ? naf0[p] : 0;
+                int d1 = (p < naf1.size()) ? naf1[p] : 0;
+                if (d0 != 0 || d1 != 0)
+                    term.push_back({s, p, src, d0, d1});
+            }
+        }
+    return term;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Exact matrix of a buffered single-qubit gate]
+
+  Description [M receives the entries 00, 01, 10, 11 in Z[omega], and
+               the matrix is M / sqrt(2)^mk.]
+
+  SideEffects []
+
+  SeeAlso     [flush_wire]
+
+***********************************************************************/
+void Simulator::gate_matrix(std::vector<int> gate, std::vector<std::vector<long long>> &M, int &mk)
+{
+    std::vector<long long> zero(w, 0);
+    std::vector<long long> one = ring_omega(w, 0);
+    std::vector<long long> none = ring_omega(w, w);
+
+    switch (gate[0])
+    {
+    case GATE_H:
+        M = {one, one, one, none};
+        mk = 1;
+        break;
+    case GATE_X:
+        M = {zero, one, one, zero};
+        mk = 0;
+        break;
+    case GATE_Y:
+        M = {zero, ring_omega(w, 3 * w / 2), ring_omega(w, w / 2), zero};
+        mk = 0;
+        break;
+    case GATE_RX:
+        M = {one, ring_omega(w, 3 * w / 2), ring_omega(w, 3 * w / 2), one};
+        mk = 1;
+        break;
+    case GATE_RY:
+        M = {one, none, one, one};
+        mk = 1;
+        break;
+    case GATE_PHASE:
+        M = {ring_omega(w, gate[1]), zero, zero, ring_omega(w, gate[2])};
+        mk = 0;
+        break;
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Buffer a single-qubit gate]
+
+  Description [gate is {code, m0, m1}, where m0 and m1 are the powers of
+               omega on the diagonal of GATE_PHASE. x and diagonal gates
+               go to the pending block unless the wire already has a run;
+               the others start or extend the run of the wire, which is
+               applied after the block.]
+
+  SideEffects []
+
+  SeeAlso     [flush_wire]
+
+***********************************************************************/
+void Simulator::gate1(std::vector<int> gate, int iqubit)
+{
+    assert((iqubit >= 0) & (iqubit < n));
+    if (wire_run.size() < n)
+        wire_run.resize(n);
+
+    if (wire_run[iqubit].empty() && gate[0] == GATE_X)
+    {
+        block_toffoli(iqubit, std::vector<int>(0));
+        return;
+    }
+    if (wire_run[iqubit].empty() && gate[0] == GATE_PHASE)
+    {
+        if (gate[1] != 0)
+            block_phase_gate(std::vector<int>(0), gate[1]);
+        block_phase_gate(std::vector<int>(1, iqubit), gate[2] - gate[1]);
+        return;
+    }
+
+    // keep the entries of the fused matrix within 2^40
+    int nk = 0;
+    for (int i = 0; i < wire_run[iqubit].size(); i++)
+        nk += (wire_run[iqubit][i][0] == GATE_H) | (wire_run[iqubit][i][0] == GATE_RX) | (wire_run[iqubit][i][0] == GATE_RY);
+    if (nk >= 40)
+        flush_wire(iqubit);
+
+    wire_run[iqubit].push_back(gate);
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Apply the pending run of single-qubit gates of a wire]
+
+  Description [The run is fused into one exact matrix, with common
+               factors of 2 taken out. It is applied with Unitary when
+               that takes fewer additions than the gates one by one, and
+               replayed gate by gate otherwise.]
+
+  SideEffects [The pending block is flushed first.]
+
+  SeeAlso     [gate1 Unitary]
+
+***********************************************************************/
+void Simulator::flush_wire(int iqubit)
+{
+    if (iqubit >= wire_run.size() || wire_run[iqubit].empty())
+        return;
+    flush_block();
+
+    std::vector<std::vector<int>> run;
+    run.swap(wire_run[iqubit]);
+
+    std::vector<std::vector<long long>> M, G;
+    int mk = 0, gk;
+    gate_matrix({GATE_PHASE, 0, 0}, M, mk);
+    for (int h = 0; h < run.size(); h++)
+    {
+        gate_matrix(run[h], G, gk);
+        std::vector<std::vector<long long>> P(4);
+        for (int a = 0; a < 2; a++)
+            for (int b = 0; b < 2; b++)
+            {
+                P[2 * a + b] = ring_mul(G[2 * a], M[b]);
+                std::vector<long long> tmp = ring_mul(G[2 * a + 1], M[2 + b]);
+                for (int s = 0; s < w; s++)
+                    P[2 * a + b][s] += tmp[s];
+            }
+        M = P;
+        mk += gk;
+    }
+    bool isEven = true;
+    while (isEven && mk >= 2)
+    {
+        for (int e = 0; e < 4; e++)
+            for (int s = 0; s < w; s++)
+                isEven &= (M[e][s] % 2 == 0);
+        if (!isEven)
+            break;
+        for (int e = 0; e < 4; e++)
+            for (int s = 0; s < w; s++)
+                M[e][s] /= 2;
+        mk -= 2;
+    }
+
+    // a diagonal of two powers of omega is only a rotation
+    int m[2] = {-1, -1};
+    for (int x = 0; x < 2 && mk == 0; x++)
+    {
+        int nz = 0;
+        for (int s = 0; s < w; s++)
+        {
+            nz += (M[3 * x][s] != 0) + (M[2 - x][s] != 0);
+            if (M[3 * x][s] == 1 || M[3 * x][s] == -1)
+                m[x] = (M[3 * x][s] == 1) ? s : s + w;
+        }
+        if (nz != 1)
+            m[x] = -1;
+    }
+    if (m[0] >= 0 && m[1] >= 0)
+    {
+        if (m[0] != 0 || m[1] != 0)
+        {
+            Phase_rotate(m[0], m[1], iqubit);
+            gatecount--;
+        }
+        gatecount += run.size();
+        return;
+    }
+
+    if (run.size() > 1 && unitary_terms(M).size() <= run.size())
+    {
+        Unitary(iqubit, M, mk);
+        gatecount += run.size() - 1;
+        return;
+    }
+    for (int h = 0; h < run.size(); h++)
+    {
+        switch (run[h][0])
+        {
+        case GATE_H:
+            Hadamard(iqubit);
+            break;
+        case GATE_X:
+            PauliX(iqubit);
+            break;
+        case GATE_Y:
+            PauliY(iqubit);
+            break;
+        case GATE_RX:
+            rx_pi_2(iqubit);
+            break;
+        case GATE_RY:
+            ry_pi_2(iqubit);
+            break;
+        case GATE_PHASE:
+            Phase_rotate(run[h][1], run[h][2], iqubit);
+            break;
+        }
+    }
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Apply an exact 2x2 matrix M / sqrt(2)^mk to iqubit]
+
+  Description [M holds the entries 00, 01, 10, 11 as coefficients of
+               omega^0 .. omega^(w-1). Both output branches are built at
+               once as a sum of signed-digit terms of the entries, each
+               a rotated, shifted and possibly negated cofactor selected
+               by the qubit; the sum is wide enough never to overflow
+               and is trimmed once by store_sum.]
+
+  SideEffects []
+
+  SeeAlso     [unitary_terms gate_matrix]
+
+***********************************************************************/
+void Simulator::Unitary(int iqubit, std::vector<std::vector<long long>> M, int mk)
+{
+    assert((iqubit >= 0) & (iqubit < n));
+    assert(M.size() == 4);
+
+    std::vector<std::vector<int>> term = unitary_terms(M);
+    assert(!term.empty());
+
+    long long bound = 0;
+    for (int x = 0; x < 2; x++)
+    {
+        long long b = 0;
+        for (int s = 0; s < w; s++)
+            b += llabs(M[2 * x][s]) + llabs(M[2 * x + 1][s]);
+        bound = std::max(bound, b);
+    }
+    // signed digits add up to at most 2 * bound times a cofactor
+    int width = r + 1;
+    while ((1LL << (width - r)) <= 2 * bound)
+        width++;
+
+    int r0 = r;
+    DdNode *var = Cudd_bddIthVar(manager, iqubit);
+    DdNode *one = Cudd_ReadOne(manager), *zero = Cudd_Not(one);
+    DdNode *base, *c;
+    DdNode ***F[2];
+    for (int x = 0; x < 2; x++)
+    {
+        F[x] = new DdNode **[w];
+        for (int i = 0; i < w; i++)
+        {
+            F[x][i] = new DdNode *[r];
+            for (int j = 0; j < r; j++)
+            {
+                F[x][i][j] = Cudd_Cofactor(manager, All_Bdd[i][j], Cudd_NotCond(var, x == 0));
+                Cudd_Ref(F[x][i][j]);
+            }
+        }
+    }
+
+    DdNode **t = new DdNode *[width];
+    DdNode ***Sum = new DdNode **[w];
+    for (int i = 0; i < w; i++)
+    {
+        DdNode **acc = NULL;
+        for (int h = 0; h < term.size(); h++)
+        {
+            int s = term[h][0], p = term[h][1], src = term[h][2], d0 = term[h][3], d1 = term[h][4];
+            bool wrap = (i + s) >= w;
+            bool neg0 = (d0 < 0) ^ wrap, neg1 = (d1 < 0) ^ wrap;
+            DdNode **f = F[src][(i + s) % w];
+
+            for (int j = 0; j < width; j++)
+            {
+                base = (j < p) ? zero : f[std::min(j - p, r - 1)];
+                t[j] = Cudd_bddIte(manager, var, d1 ? Cudd_NotCond(base, neg1) : zero, d0 ? Cudd_NotCond(base, neg0) : zero);
+                Cudd_Ref(t[j]);
+            }
+            // negated as complement + c
+            if (d0 && neg0)
+                c = (d1 && neg1) ? one : Cudd_Not(var);
+            else
+                c = (d1 && neg1) ? var : zero;
+
+            DdNode **sum = new DdNode *[width + 1];
+            add_vector(t, acc, c, sum, width);
+            Cudd_RecursiveDeref(manager, sum[width]);
+            for (int j = 0; j < width; j++)
+                Cudd_RecursiveDeref(manager, t[j]);
+            if (acc != NULL)
+            {
+                for (int j = 0; j < width; j++)
+                    Cudd_RecursiveDeref(manager, acc[j]);
+                delete[] acc;
+            }
+            acc = sum;
+        }
+        Sum[i] = acc;
+    }
+    store_sum(Sum, width);
+    k = k + mk;
+
+    for (int x = 0; x < 2; x++)
+    {
+        for (int i = 0; i < w; i++)
+        {
+            for (int j = 0; j < r0; j++)
+                Cudd_RecursiveDeref(manager, F[x][i][j]);
+            delete[] F[x][i];
+        }
+        delete[] F[x];
+    }
+    delete[] t;
+    gatecount++;
+    nodecount();
+}
@@ -1,4 +1,5 @@
 #include "util_sim.h"
+#include <cmath>
 
 
 /**Function*************************************************************
@@ -91,4 +92,46 @@ int int_array_full_check(int length, int *reg)
         check *= reg[i];
 
     return check;
+}
+
+/**Function*************************************************************
+
+  Synopsis    [Evaluate a gate angle such as "pi/4", "-3*pi/8" or "0.25"]
+
+  Description [Only products and quotients of numbers and pi are
+               supported, which covers what Qiskit and PennyLane export.]
+               
+  SideEffects []
+
+  SeeAlso     []
+
+***********************************************************************/
+double parse_angle(std::string expr)
+{
+    std::string s;
+    for (char ch : expr)
+        if (ch != ' ' && ch != '(' && ch != ')')
+            s += ch;
+
+    double value = 1, factor;
+    char op = '*';
+    size_t pos = 0;
+    if (!s.empty() && (s[0] == '-' || s[0] == '+'))
+    {
+        value = (s[0] == '-') ? -1 : 1;
+        pos = 1;
+    }
+    while (pos < s.size())
+    {
+        size_t end = s.find_first_of("*/", pos);
+        if (end == std::string::npos)
+            end = s.size();
+        std::string term = s.substr(pos, end - pos);
+        factor = (term == "pi") ? M_PI : std::stod(term);
+        value = (op == '*') ? value * factor : value / factor;
+        if (end < s.size())
+            op = s[end];
+        pos = end + 1;
+    }
+    return value;
 }
\ No newline at end of file